@@ -1,175 +1,768 @@
-//
-// recorder.cpp
-// Compile with:
-// audio09e.cpp
-// Single-file screen + audio recorder using WASAPI and FFmpeg (FFmpeg 6.x+ friendly)
-#include <windows.h>
-#include <audioclient.h>
-#include <mmdeviceapi.h>
-#include <iostream>
-#include <fstream>
-#include <vector>
-#include <comdef.h>
-#include <cstdint>
-#include <algorithm>
-#include <ctime>
-#include <sstream>
-#include <iomanip>
-
-
-#pragma comment(lib, "ole32.lib")
-#pragma comment(lib, "avrt.lib")
-
-// WAV header struct (unchanged)
-struct WAVHeader {
-    char riff[4] = {'R','I','F','F'};
-    uint32_t chunkSize;
-    char wave[4] = {'W','A','V','E'};
-    char fmt[4] = {'f','m','t',' '};
-    uint32_t subChunk1Size = 16;
-    uint16_t audioFormat = 1; // PCM
-    uint16_t numChannels;
-    uint32_t sampleRate;
-    uint32_t byteRate;
-    uint16_t blockAlign;
-    uint16_t bitsPerSample;
-    char data[4] = {'d','a','t','a'};
-    uint32_t dataSize;
-};
-
-// Function to write the WAV header (unchanged)
-void WriteWAVHeader(std::ofstream &outFile, uint16_t channels, uint32_t sampleRate, uint16_t bitsPerSample, uint32_t dataSize) {
-    WAVHeader header;
-    header.numChannels = channels;
-    header.sampleRate = sampleRate;
-    header.bitsPerSample = bitsPerSample;
-    header.byteRate = sampleRate * channels * bitsPerSample / 8;
-    header.blockAlign = channels * bitsPerSample / 8;
-    header.dataSize = dataSize;
-    header.chunkSize = 36 + dataSize;
-
-    outFile.write(reinterpret_cast<char*>(&header), sizeof(header));
-}
-
-// Function to get the current time as a formatted string (YYYYMMDD_HHMMSS)
-std::string GetTimestamp() {
-    // Get current time
-    std::time_t now = std::time(nullptr);
-    std::tm* tmStruct = std::localtime(&now);
-
-    // Format time into YYYYMMDD_HHMMSS
-    std::stringstream ss;
-    ss << (tmStruct->tm_year + 1900)  // year
-       << std::setw(2) << std::setfill('0') << (tmStruct->tm_mon + 1) // month
-       << std::setw(2) << std::setfill('0') << tmStruct->tm_mday      // day
-       << "_"
-       << std::setw(2) << std::setfill('0') << tmStruct->tm_hour      // hour
-       << std::setw(2) << std::setfill('0') << tmStruct->tm_min       // minute
-       << std::setw(2) << std::setfill('0') << tmStruct->tm_sec;      // second
-    return ss.str();
-}
-
-int main() {
-    CoInitialize(nullptr);
-
-    IMMDeviceEnumerator* pEnumerator = nullptr;
-    IMMDevice* pDevice = nullptr;
-    IAudioClient* pAudioClient = nullptr;
-    IAudioCaptureClient* pCaptureClient = nullptr;
-
-    if (FAILED(CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_ALL,
-                                __uuidof(IMMDeviceEnumerator), (void**)&pEnumerator))) {
-        std::cerr << "Failed to create enumerator\n"; return -1;
-    }
-
-    if (FAILED(pEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &pDevice))) {
-        std::cerr << "Failed to get default device\n"; return -1;
-    }
-
-    if (FAILED(pDevice->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void**)&pAudioClient))) {
-        std::cerr << "Failed to activate audio client\n"; return -1;
-    }
-
-    WAVEFORMATEX* pwfx = nullptr;
-    if (FAILED(pAudioClient->GetMixFormat(&pwfx))) {
-        std::cerr << "Failed to get mix format\n"; return -1;
-    }
-
-    if (FAILED(pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, AUDCLNT_STREAMFLAGS_LOOPBACK,
-                                        10000000, 0, pwfx, nullptr))) {
-        std::cerr << "Failed to initialize audio client\n"; return -1;
-    }
-
-    if (FAILED(pAudioClient->GetService(__uuidof(IAudioCaptureClient), (void**)&pCaptureClient))) {
-        std::cerr << "Failed to get capture client\n"; return -1;
-    }
-
-    if (FAILED(pAudioClient->Start())) {
-        std::cerr << "Failed to start capture\n"; return -1;
-    }
-
-    std::cout << "Recording system audio. Press Enter to stop...\n";
-
-    // Generate a dynamic file name with timestamp
-    std::string fileName = "recording_" + GetTimestamp() + ".wav";
-
-    std::ofstream outFile(fileName, std::ios::binary);
-    WriteWAVHeader(outFile, pwfx->nChannels, pwfx->nSamplesPerSec, 16, 0); // 16-bit PCM output
-
-    std::vector<BYTE> audioData;
-    bool recording = true;
-    float maxSample = 0.0f;
-
-    while (recording) {
-        UINT32 packetLength = 0;
-        if (FAILED(pCaptureClient->GetNextPacketSize(&packetLength))) break;
-
-        while (packetLength != 0) {
-            BYTE* pData;
-            UINT32 numFrames;
-            DWORD flags;
-
-            if (FAILED(pCaptureClient->GetBuffer(&pData, &numFrames, &flags, nullptr, nullptr))) break;
-
-            if (!(flags & AUDCLNT_BUFFERFLAGS_SILENT)) {
-                float* fData = reinterpret_cast<float*>(pData);
-                for (UINT32 i = 0; i < numFrames * pwfx->nChannels; i++) {
-                    maxSample = std::max(maxSample, std::abs(fData[i]));
-                }
-
-                for (UINT32 i = 0; i < numFrames * pwfx->nChannels; i++) {
-                    float sample = fData[i];
-                    if (maxSample > 1.0f) sample /= maxSample; // dynamic scaling
-                    int16_t s16 = static_cast<int16_t>(std::clamp(sample, -1.0f, 1.0f) * 32767.0f);
-                    audioData.push_back(s16 & 0xFF);
-                    audioData.push_back((s16 >> 8) & 0xFF);
-                }
-            } else {
-                audioData.insert(audioData.end(), numFrames * pwfx->nBlockAlign, 0);
-            }
-
-            if (FAILED(pCaptureClient->ReleaseBuffer(numFrames))) break;
-            if (FAILED(pCaptureClient->GetNextPacketSize(&packetLength))) break;
-        }
-
-        if (GetAsyncKeyState(VK_RETURN) & 0x8000) recording = false;
-        Sleep(10);
-    }
-
-    pAudioClient->Stop();
-
-    outFile.seekp(0, std::ios::beg);
-    WriteWAVHeader(outFile, pwfx->nChannels, pwfx->nSamplesPerSec, 16, static_cast<uint32_t>(audioData.size()));
-    outFile.write(reinterpret_cast<char*>(audioData.data()), audioData.size());
-    outFile.close();
-
-    CoTaskMemFree(pwfx);
-    if (pCaptureClient) pCaptureClient->Release();
-    if (pAudioClient) pAudioClient->Release();
-    if (pDevice) pDevice->Release();
-    if (pEnumerator) pEnumerator->Release();
-    CoUninitialize();
-
-    std::cout << "Recording finished: " << fileName << "\n";
-    return 0;
-}
+//
+// recorder.cpp
+// Compile with:
+// audio09e.cpp
+// Single-file screen + audio recorder using WASAPI and FFmpeg (FFmpeg 6.x+ friendly)
+#include <windows.h>
+#include <audioclient.h>
+#include <mmdeviceapi.h>
+#include <mmreg.h>
+#include <ksmedia.h>
+#include <avrt.h>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <comdef.h>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <ctime>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cmath>
+#include <random>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define AUDIO_SIMD_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define AUDIO_SIMD_SSE2 1
+#endif
+
+
+#pragma comment(lib, "ole32.lib")
+#pragma comment(lib, "avrt.lib")
+
+// Size of the largest header WriteWAVHeader emits
+const uint32_t kMaxWAVHeaderBytes = 80;
+
+// Writes the WAV header. 16-bit PCM in mono or stereo gets the classic
+// 16-byte fmt chunk; everything else (24-bit, float, more than two
+// channels) WAVE_FORMAT_EXTENSIBLE with the channel mask and sample
+// subformat, as readers expect, and float data its fact chunk.
+// channelMask 0 means the usual layout for mono and stereo, otherwise
+// unspecified.
+void WriteWAVHeader(std::ofstream &outFile, uint16_t channels, uint32_t sampleRate, uint16_t bitsPerSample, uint32_t dataSize,
+                    uint16_t audioFormat = WAVE_FORMAT_PCM, uint32_t channelMask = 0) {
+    const uint16_t blockAlign = channels * bitsPerSample / 8;
+    const bool isFloat = audioFormat == WAVE_FORMAT_IEEE_FLOAT;
+    const bool extensible = isFloat || bitsPerSample > 16 || channels > 2;
+    const uint32_t fmtBytes = extensible ? 40 : 16;
+    const uint32_t factBytes = isFloat ? 12 : 0;
+    if (!channelMask && channels == 1) channelMask = SPEAKER_FRONT_CENTER;
+    if (!channelMask && channels == 2) channelMask = SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT;
+
+    std::vector<char> header;
+    auto put = [&](const void* data, size_t bytes) {
+        header.insert(header.end(), (const char*)data, (const char*)data + bytes);
+    };
+    auto put16 = [&](uint16_t value) { put(&value, 2); };
+    auto put32 = [&](uint32_t value) { put(&value, 4); };
+    put("RIFF", 4);
+    put32(4 + 8 + fmtBytes + factBytes + 8 + dataSize);
+    put("WAVE", 4);
+    put("fmt ", 4);
+    put32(fmtBytes);
+    put16(extensible ? WAVE_FORMAT_EXTENSIBLE : audioFormat);
+    put16(channels);
+    put32(sampleRate);
+    put32(sampleRate * blockAlign); // byte rate
+    put16(blockAlign);
+    put16(bitsPerSample);
+    if (extensible) {
+        put16(22); // cbSize: the extension below
+        put16(bitsPerSample); // valid bits
+        put32(channelMask);
+        put(isFloat ? &KSDATAFORMAT_SUBTYPE_IEEE_FLOAT : &KSDATAFORMAT_SUBTYPE_PCM, sizeof(GUID));
+    }
+    if (isFloat) {
+        put("fact", 4);
+        put32(4);
+        put32(blockAlign ? dataSize / blockAlign : 0); // frames
+    }
+    put("data", 4);
+    put32(dataSize);
+    outFile.write(header.data(), header.size());
+}
+
+// Converts float samples to int16 in one pass: scales by gain, clamps to
+// [-1, 1], truncates like static_cast<int16_t>, and returns the peak |sample|
+// of the input (before gain) so the caller can track the running maximum.
+// With dither (one value per sample, in LSBs) it is added before rounding
+// to nearest instead.
+float ConvertFloatToInt16(const float* src, int16_t* dst, size_t count, float gain, const float* dither = nullptr) {
+    const float scale = gain * 32767.0f;
+    size_t i = 0;
+    float peak = 0.0f;
+#if defined(AUDIO_SIMD_AVX2)
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    const __m256 vScale = _mm256_set1_ps(scale);
+    const __m256 vMax = _mm256_set1_ps(32767.0f);
+    const __m256 vMin = _mm256_set1_ps(-32767.0f);
+    __m256 vPeak = _mm256_setzero_ps();
+    for (; i + 16 <= count; i += 16) {
+        __m256 a = _mm256_loadu_ps(src + i);
+        __m256 b = _mm256_loadu_ps(src + i + 8);
+        vPeak = _mm256_max_ps(vPeak, _mm256_and_ps(a, absMask));
+        vPeak = _mm256_max_ps(vPeak, _mm256_and_ps(b, absMask));
+        a = _mm256_mul_ps(a, vScale);
+        b = _mm256_mul_ps(b, vScale);
+        if (dither) {
+            a = _mm256_add_ps(a, _mm256_loadu_ps(dither + i));
+            b = _mm256_add_ps(b, _mm256_loadu_ps(dither + i + 8));
+        }
+        a = _mm256_min_ps(_mm256_max_ps(a, vMin), vMax);
+        b = _mm256_min_ps(_mm256_max_ps(b, vMin), vMax);
+        // packs works per 128-bit lane; the permute restores sample order
+        __m256i packed = dither ? _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b))
+                                : _mm256_packs_epi32(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), packed);
+    }
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, vPeak);
+    for (float lane : lanes) peak = std::max(peak, lane);
+#elif defined(AUDIO_SIMD_SSE2)
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 vScale = _mm_set1_ps(scale);
+    const __m128 vMax = _mm_set1_ps(32767.0f);
+    const __m128 vMin = _mm_set1_ps(-32767.0f);
+    __m128 vPeak = _mm_setzero_ps();
+    for (; i + 8 <= count; i += 8) {
+        __m128 a = _mm_loadu_ps(src + i);
+        __m128 b = _mm_loadu_ps(src + i + 4);
+        vPeak = _mm_max_ps(vPeak, _mm_and_ps(a, absMask));
+        vPeak = _mm_max_ps(vPeak, _mm_and_ps(b, absMask));
+        a = _mm_mul_ps(a, vScale);
+        b = _mm_mul_ps(b, vScale);
+        if (dither) {
+            a = _mm_add_ps(a, _mm_loadu_ps(dither + i));
+            b = _mm_add_ps(b, _mm_loadu_ps(dither + i + 4));
+        }
+        a = _mm_min_ps(_mm_max_ps(a, vMin), vMax);
+        b = _mm_min_ps(_mm_max_ps(b, vMin), vMax);
+        __m128i packed = dither ? _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b))
+                                : _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+    }
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, vPeak);
+    for (float lane : lanes) peak = std::max(peak, lane);
+#endif
+    // Scalar tail (and the whole buffer without SIMD)
+    for (; i < count; ++i) {
+        peak = std::max(peak, std::abs(src[i]));
+        if (dither) {
+            dst[i] = static_cast<int16_t>(std::lrint(std::clamp(src[i] * scale + dither[i], -32767.0f, 32767.0f)));
+        } else {
+            dst[i] = static_cast<int16_t>(std::clamp(src[i] * gain, -1.0f, 1.0f) * 32767.0f);
+        }
+    }
+    return peak;
+}
+
+// The same for packed little-endian 24-bit samples. SIMD does the scaling
+// and rounding; the 3-byte stores stay scalar.
+float ConvertFloatToInt24(const float* src, uint8_t* dst, size_t count, float gain, const float* dither = nullptr) {
+    const float scale = gain * 8388607.0f;
+    size_t i = 0;
+    float peak = 0.0f;
+#if defined(AUDIO_SIMD_AVX2) || defined(AUDIO_SIMD_SSE2)
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 vScale = _mm_set1_ps(scale);
+    const __m128 vMax = _mm_set1_ps(8388607.0f);
+    const __m128 vMin = _mm_set1_ps(-8388607.0f);
+    __m128 vPeak = _mm_setzero_ps();
+    alignas(16) int32_t ints[4];
+    for (; i + 4 <= count; i += 4) {
+        __m128 a = _mm_loadu_ps(src + i);
+        vPeak = _mm_max_ps(vPeak, _mm_and_ps(a, absMask));
+        a = _mm_mul_ps(a, vScale);
+        if (dither) a = _mm_add_ps(a, _mm_loadu_ps(dither + i));
+        a = _mm_min_ps(_mm_max_ps(a, vMin), vMax);
+        _mm_store_si128(reinterpret_cast<__m128i*>(ints), dither ? _mm_cvtps_epi32(a) : _mm_cvttps_epi32(a));
+        for (int k = 0; k < 4; ++k) {
+            uint8_t* out = dst + (i + k) * 3;
+            out[0] = (uint8_t)ints[k];
+            out[1] = (uint8_t)(ints[k] >> 8);
+            out[2] = (uint8_t)(ints[k] >> 16);
+        }
+    }
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, vPeak);
+    for (float lane : lanes) peak = std::max(peak, lane);
+#endif
+    for (; i < count; ++i) {
+        peak = std::max(peak, std::abs(src[i]));
+        float x = std::clamp(src[i] * scale + (dither ? dither[i] : 0.0f), -8388607.0f, 8388607.0f);
+        int32_t v = dither ? (int32_t)std::lrint(x) : (int32_t)x;
+        uint8_t* out = dst + i * 3;
+        out[0] = (uint8_t)v;
+        out[1] = (uint8_t)(v >> 8);
+        out[2] = (uint8_t)(v >> 16);
+    }
+    return peak;
+}
+
+// Triangular (TPDF) dither of +-1 LSB, generated once. The table is longer
+// than its period by the largest run asked for, so any run can be read
+// straight from it without wrapping.
+class DitherTable {
+public:
+    void init(size_t maxRun) {
+        std::minstd_rand rng(12345);
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        values.resize(kPeriod + maxRun);
+        for (size_t i = 0; i < kPeriod; ++i) values[i] = uniform(rng) - uniform(rng);
+        for (size_t i = kPeriod; i < values.size(); ++i) values[i] = values[i - kPeriod];
+    }
+
+    // count must not exceed init's maxRun
+    const float* next(size_t count) {
+        const float* run = values.data() + offset;
+        offset = (offset + count) % kPeriod;
+        return run;
+    }
+
+private:
+    static const size_t kPeriod = 1 << 16;
+    std::vector<float> values;
+    size_t offset = 0;
+};
+
+// Polyphase windowed-sinc resampler for interleaved float audio, for any
+// rational ratio out/in = L/M. The L filter phases are computed up front,
+// so each output sample is one SIMD dot product per channel.
+class Resampler {
+public:
+    static const int kTaps = 32; // per phase, a multiple of 8
+    static const uint32_t kMaxPhases = 1024;
+
+    // False for ratios needing too many phases to precompute, e.g. 48000 -> 44099
+    static bool supports(uint32_t inRate, uint32_t outRate) { return outRate / gcd(inRate, outRate) <= kMaxPhases; }
+
+    bool init(int channels, uint32_t inRate, uint32_t outRate) {
+        if (!supports(inRate, outRate)) return false;
+        uint32_t g = gcd(inRate, outRate);
+        up = outRate / g;
+        down = inRate / g;
+        this->channels = channels;
+
+        // Cut off just below the lower Nyquist frequency, relative to the input's
+        const double cutoff = 0.95 * std::min(1.0, (double)up / down);
+        const double pi = 3.14159265358979323846;
+        const double center = kTaps / 2 - 1;
+        bank.assign((size_t)up * kTaps, 0.0f);
+        for (uint32_t p = 0; p < up; ++p) {
+            double sum = 0.0;
+            for (int k = 0; k < kTaps; ++k) {
+                double d = k - center - (double)p / up; // distance from the output instant, in input samples
+                double x = cutoff * d;
+                double sinc = x == 0.0 ? 1.0 : std::sin(pi * x) / (pi * x);
+                double w = 0.42 + 0.5 * std::cos(pi * d / (kTaps / 2)) + 0.08 * std::cos(2 * pi * d / (kTaps / 2));
+                bank[p * kTaps + k] = (float)(sinc * std::max(0.0, w));
+                sum += bank[p * kTaps + k];
+            }
+            for (int k = 0; k < kTaps; ++k) bank[p * kTaps + k] = (float)(bank[p * kTaps + k] / sum); // unity DC gain
+        }
+        history.assign(channels, std::vector<float>(kTaps - 1, 0.0f));
+        return true;
+    }
+
+    // Appends the output for these input frames to out (interleaved)
+    void process(const float* in, size_t frames, std::vector<float>& out) {
+        for (int c = 0; c < channels; ++c) {
+            std::vector<float>& h = history[c];
+            size_t base = h.size();
+            h.resize(base + frames);
+            for (size_t i = 0; i < frames; ++i) h[base + i] = in ? in[i * channels + c] : 0.0f;
+        }
+        size_t available = history[0].size();
+        size_t first = out.size();
+        out.reserve(first + (frames * up / down + 2) * channels);
+        size_t pos = 0;
+        uint32_t ph = phase;
+        size_t produced = 0;
+        while (pos + kTaps <= available) {
+            out.resize(first + (produced + 1) * channels);
+            float* frame = out.data() + first + produced * channels;
+            const float* taps = bank.data() + (size_t)ph * kTaps;
+            for (int c = 0; c < channels; ++c) frame[c] = dot(taps, history[c].data() + pos);
+            ++produced;
+            ph += down;
+            pos += ph / up;
+            ph %= up;
+        }
+        // Keep what the next output still needs
+        for (std::vector<float>& h : history) h.erase(h.begin(), h.begin() + pos);
+        phase = ph;
+    }
+
+    // At the end of the stream: pushes the samples still in the filter
+    // delay line out through one filter length of silence
+    void finish(std::vector<float>& out) { process(nullptr, kTaps, out); }
+
+private:
+    static uint32_t gcd(uint32_t a, uint32_t b) {
+        while (b) {
+            uint32_t t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+
+    static float dot(const float* taps, const float* x) {
+#if defined(AUDIO_SIMD_AVX2)
+        __m256 acc = _mm256_setzero_ps();
+        for (int k = 0; k < kTaps; k += 8) acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(taps + k), _mm256_loadu_ps(x + k)));
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+#elif defined(AUDIO_SIMD_SSE2)
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < kTaps; k += 4) sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(taps + k), _mm_loadu_ps(x + k)));
+#endif
+#if defined(AUDIO_SIMD_AVX2) || defined(AUDIO_SIMD_SSE2)
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+#else
+        float sum = 0.0f;
+        for (int k = 0; k < kTaps; ++k) sum += taps[k] * x[k];
+        return sum;
+#endif
+    }
+
+    int channels = 0;
+    uint32_t up = 1;
+    uint32_t down = 1;
+    std::vector<float> bank;                 // up phases x kTaps
+    std::vector<std::vector<float>> history; // per channel, from the oldest sample still needed
+    uint32_t phase = 0;                      // of the next output, in 1/up input samples
+};
+
+// Streams PCM to a WAV file in fixed-size chunks. The capture loop fills one
+// buffer while a background thread writes the other, so memory use stays
+// constant however long the recording runs. The RIFF sizes are patched in
+// close().
+class WavStreamWriter {
+public:
+    ~WavStreamWriter() { close(); }
+
+    bool open(const std::string& fileName, uint16_t channels, uint32_t sampleRate, uint16_t bitsPerSample,
+              uint16_t audioFormat = WAVE_FORMAT_PCM, uint32_t channelMask = 0, size_t chunkBytes = 1 << 20) {
+        outFile.open(fileName, std::ios::binary);
+        if (!outFile) return false;
+        this->channels = channels;
+        this->sampleRate = sampleRate;
+        this->bitsPerSample = bitsPerSample;
+        this->audioFormat = audioFormat;
+        this->channelMask = channelMask;
+        WriteWAVHeader(outFile, channels, sampleRate, bitsPerSample, 0, audioFormat, channelMask); // sizes patched on close
+        for (auto& buffer : buffers) buffer.resize(chunkBytes);
+        worker = std::thread(&WavStreamWriter::writerLoop, this);
+        return true;
+    }
+
+    void append(const void* data, size_t bytes) {
+        const BYTE* src = static_cast<const BYTE*>(data);
+        while (bytes > 0) {
+            size_t n = std::min(bytes, buffers[active].size() - used);
+            memcpy(buffers[active].data() + used, src, n);
+            used += n;
+            src += n;
+            bytes -= n;
+            if (used == buffers[active].size()) submit();
+        }
+    }
+
+    void appendZeros(size_t bytes) {
+        while (bytes > 0) {
+            size_t n = std::min(bytes, buffers[active].size() - used);
+            memset(buffers[active].data() + used, 0, n);
+            used += n;
+            bytes -= n;
+            if (used == buffers[active].size()) submit();
+        }
+    }
+
+    // Flushes the last partial chunk, stops the writer and fixes the header
+    void close() {
+        if (!worker.joinable()) return;
+        if (used > 0) submit();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+
+        // RIFF sizes are 32-bit; anything past 4 GB is still on disk but
+        // only readers that ignore the header will see it
+        uint32_t dataSize = (uint32_t)std::min<uint64_t>(dataBytes, 0xFFFFFFFFull - kMaxWAVHeaderBytes);
+        outFile.seekp(0, std::ios::beg);
+        WriteWAVHeader(outFile, channels, sampleRate, bitsPerSample, dataSize, audioFormat, channelMask);
+        outFile.close();
+    }
+
+private:
+    // Hands the active buffer to the writer and switches to the other one,
+    // waiting only if the disk has fallen a whole chunk behind
+    void submit() {
+        std::unique_lock<std::mutex> lock(mutex);
+        pendingBytes[active] = used;
+        cv.notify_all();
+        active ^= 1;
+        used = 0;
+        cv.wait(lock, [&] { return pendingBytes[active] == 0; });
+    }
+
+    void writerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        int next = 0; // buffers are written in the order they were filled
+        for (;;) {
+            cv.wait(lock, [&] { return pendingBytes[next] != 0 || stopping; });
+            if (pendingBytes[next] == 0) return; // stopping and nothing left
+            size_t bytes = pendingBytes[next];
+            lock.unlock();
+            outFile.write(reinterpret_cast<const char*>(buffers[next].data()), bytes);
+            lock.lock();
+            dataBytes += bytes;
+            pendingBytes[next] = 0;
+            cv.notify_all();
+            next ^= 1;
+        }
+    }
+
+    std::ofstream outFile;
+    uint16_t channels = 0;
+    uint32_t sampleRate = 0;
+    uint16_t bitsPerSample = 0;
+    uint16_t audioFormat = WAVE_FORMAT_PCM;
+    uint32_t channelMask = 0;
+    std::vector<BYTE> buffers[2];
+    int active = 0;     // buffer the capture loop is filling
+    size_t used = 0;    // bytes filled in the active buffer
+    size_t pendingBytes[2] = { 0, 0 }; // non-zero while queued for the writer
+    uint64_t dataBytes = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread worker;
+};
+
+// Turns mix-format packets (32-bit float) into what the WAV file stores:
+// float passed through untouched, or 16/24-bit PCM with optional dither,
+// optionally resampled first. Silent packets become silence of the output
+// format's size, and go through the resampler like any other so its timing
+// and state stay continuous.
+enum class SampleFormat { Float32, Int16, Int24 };
+
+class FormatStage {
+public:
+    bool init(int channels, uint32_t mixRate, SampleFormat format, uint32_t outRate, bool dither, size_t maxPacketFrames) {
+        this->channels = channels;
+        this->format = format;
+        this->mixRate = mixRate;
+        this->outRate = outRate ? outRate : mixRate;
+        if (this->outRate != mixRate) {
+            if (!resampler.init(channels, mixRate, this->outRate)) return false;
+            resampling = true;
+        }
+        // The resampler may produce a couple of frames more than it takes
+        size_t maxRun = (maxPacketFrames * this->outRate / mixRate + 4) * channels;
+        if (dither && format != SampleFormat::Float32) ditherTable.init(maxRun);
+        this->dither = dither && format != SampleFormat::Float32;
+        return true;
+    }
+
+    uint16_t bitsPerSample() const { return format == SampleFormat::Int16 ? 16 : format == SampleFormat::Int24 ? 24 : 32; }
+    uint16_t audioFormat() const { return format == SampleFormat::Float32 ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM; }
+    uint32_t sampleRate() const { return outRate; }
+
+    // data is nullptr for a silent packet
+    void process(const BYTE* data, UINT32 frames, WavStreamWriter& writer) {
+        const float* samples = reinterpret_cast<const float*>(data);
+        size_t count = (size_t)frames * channels;
+        if (resampling) {
+            resampled.clear();
+            resampler.process(samples, frames, resampled);
+            samples = resampled.data();
+            count = resampled.size();
+        } else if (!samples) {
+            writer.appendZeros(count * (bitsPerSample() / 8));
+            return;
+        }
+        write(samples, count, writer);
+    }
+
+    // At the end of the recording, before the writer is closed
+    void finish(WavStreamWriter& writer) {
+        if (!resampling) return;
+        resampled.clear();
+        resampler.finish(resampled);
+        write(resampled.data(), resampled.size(), writer);
+    }
+
+private:
+    void write(const float* samples, size_t count, WavStreamWriter& writer) {
+        switch (format) {
+        case SampleFormat::Float32:
+            writer.append(samples, count * sizeof(float)); // no conversion at all
+            break;
+        case SampleFormat::Int16: {
+            int16Samples.resize(count); // only grows, so no steady-state allocation
+            float peak = ConvertFloatToInt16(samples, int16Samples.data(), count, gain(), ditherRun(count));
+            maxSample = std::max(maxSample, peak);
+            writer.append(int16Samples.data(), count * sizeof(int16_t));
+            break;
+        }
+        case SampleFormat::Int24: {
+            int24Bytes.resize(count * 3);
+            float peak = ConvertFloatToInt24(samples, int24Bytes.data(), count, gain(), ditherRun(count));
+            maxSample = std::max(maxSample, peak);
+            writer.append(int24Bytes.data(), int24Bytes.size());
+            break;
+        }
+        }
+    }
+
+    // Dynamic scaling uses the peak seen before this packet, so conversion
+    // and peak tracking share one pass; a packet that raises the peak is
+    // clamped rather than rescaled
+    float gain() const { return maxSample > 1.0f ? 1.0f / maxSample : 1.0f; }
+    const float* ditherRun(size_t count) { return dither ? ditherTable.next(count) : nullptr; }
+
+    int channels = 0;
+    SampleFormat format = SampleFormat::Int16;
+    uint32_t mixRate = 0;
+    uint32_t outRate = 0;
+    bool resampling = false;
+    bool dither = false;
+    Resampler resampler;
+    DitherTable ditherTable;
+    std::vector<float> resampled;
+    std::vector<int16_t> int16Samples;
+    std::vector<uint8_t> int24Bytes;
+    float maxSample = 0.0f;
+};
+
+// Function to get the current time as a formatted string (YYYYMMDD_HHMMSS)
+std::string GetTimestamp() {
+    // Get current time
+    std::time_t now = std::time(nullptr);
+    std::tm* tmStruct = std::localtime(&now);
+
+    // Format time into YYYYMMDD_HHMMSS
+    std::stringstream ss;
+    ss << (tmStruct->tm_year + 1900)  // year
+       << std::setw(2) << std::setfill('0') << (tmStruct->tm_mon + 1) // month
+       << std::setw(2) << std::setfill('0') << tmStruct->tm_mday      // day
+       << "_"
+       << std::setw(2) << std::setfill('0') << tmStruct->tm_hour      // hour
+       << std::setw(2) << std::setfill('0') << tmStruct->tm_min       // minute
+       << std::setw(2) << std::setfill('0') << tmStruct->tm_sec;      // second
+    return ss.str();
+}
+
+int main(int argc, char** argv) {
+    // WASAPI buffer length; packets still arrive every device period
+    // (~10 ms), this is only the headroom before samples are lost
+    int bufferMs = 100;
+    std::string formatName = "s16"; // f32 (the mix format as is), s16 or s24
+    bool dither = false;            // TPDF dither for s16/s24
+    int outRate = 0;                // resample to this rate, 0 = the mix rate
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--buffer-ms" && i + 1 < argc) {
+            bufferMs = std::atoi(argv[++i]);
+        } else if (arg == "--format" && i + 1 < argc) {
+            formatName = argv[++i];
+        } else if (arg == "--dither") {
+            dither = true;
+        } else if (arg == "--rate" && i + 1 < argc) {
+            outRate = std::atoi(argv[++i]);
+        } else {
+            std::cerr << "Unknown or incomplete option: " << arg << "\n"; return -1;
+        }
+    }
+    if (bufferMs < 10 || bufferMs > 2000) {
+        std::cerr << "--buffer-ms must be between 10 and 2000\n"; return -1;
+    }
+    SampleFormat format;
+    if (formatName == "f32") format = SampleFormat::Float32;
+    else if (formatName == "s16") format = SampleFormat::Int16;
+    else if (formatName == "s24") format = SampleFormat::Int24;
+    else {
+        std::cerr << "--format must be f32, s16 or s24\n"; return -1;
+    }
+    if (outRate != 0 && (outRate < 8000 || outRate > 384000)) {
+        std::cerr << "--rate must be between 8000 and 384000\n"; return -1;
+    }
+
+    CoInitialize(nullptr);
+
+    IMMDeviceEnumerator* pEnumerator = nullptr;
+    IMMDevice* pDevice = nullptr;
+    IAudioClient* pAudioClient = nullptr;
+    IAudioCaptureClient* pCaptureClient = nullptr;
+
+    if (FAILED(CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_ALL,
+                                __uuidof(IMMDeviceEnumerator), (void**)&pEnumerator))) {
+        std::cerr << "Failed to create enumerator\n"; return -1;
+    }
+
+    if (FAILED(pEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &pDevice))) {
+        std::cerr << "Failed to get default device\n"; return -1;
+    }
+
+    if (FAILED(pDevice->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void**)&pAudioClient))) {
+        std::cerr << "Failed to activate audio client\n"; return -1;
+    }
+
+    WAVEFORMATEX* pwfx = nullptr;
+    if (FAILED(pAudioClient->GetMixFormat(&pwfx))) {
+        std::cerr << "Failed to get mix format\n"; return -1;
+    }
+    // Shared-mode mix formats are 32-bit float in practice; everything
+    // below relies on it
+    bool isFloat = pwfx->wFormatTag == WAVE_FORMAT_IEEE_FLOAT;
+    if (pwfx->wFormatTag == WAVE_FORMAT_EXTENSIBLE) {
+        isFloat = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(pwfx)->SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+    }
+    if (!isFloat || pwfx->wBitsPerSample != 32) {
+        std::cerr << "Mix format is not 32-bit float\n"; return -1;
+    }
+    if (outRate && (uint32_t)outRate != pwfx->nSamplesPerSec && !Resampler::supports(pwfx->nSamplesPerSec, outRate)) {
+        std::cerr << "--rate " << outRate << " cannot be resampled from the " << pwfx->nSamplesPerSec
+                  << " Hz mix rate; pick a rate with a simpler ratio (44100, 48000, 96000, ...)\n"; return -1;
+    }
+
+    // Event-driven capture: the engine signals audioEvent once per period.
+    // Loopback only supports this from Windows 10 1703 on, so fall back to a
+    // 10 ms poll where Initialize or SetEventHandle refuses it.
+    REFERENCE_TIME bufferDuration = (REFERENCE_TIME)bufferMs * 10000; // hns
+    HANDLE audioEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    bool eventDriven = SUCCEEDED(pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
+                                                          AUDCLNT_STREAMFLAGS_LOOPBACK | AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+                                                          bufferDuration, 0, pwfx, nullptr)) &&
+                       SUCCEEDED(pAudioClient->SetEventHandle(audioEvent));
+    if (!eventDriven) {
+        // A client can only be initialized once, so start over with a new one
+        pAudioClient->Release();
+        pAudioClient = nullptr;
+        if (FAILED(pDevice->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void**)&pAudioClient)) ||
+            FAILED(pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, AUDCLNT_STREAMFLAGS_LOOPBACK,
+                                            bufferDuration, 0, pwfx, nullptr))) {
+            std::cerr << "Failed to initialize audio client\n"; return -1;
+        }
+        std::cerr << "Event-driven loopback unavailable, polling every 10 ms\n";
+    }
+
+    if (FAILED(pAudioClient->GetService(__uuidof(IAudioCaptureClient), (void**)&pCaptureClient))) {
+        std::cerr << "Failed to get capture client\n"; return -1;
+    }
+
+    if (FAILED(pAudioClient->Start())) {
+        std::cerr << "Failed to start capture\n"; return -1;
+    }
+
+    // Glitch-sensitive work: let MMCSS boost this thread under CPU load
+    DWORD mmcssTask = 0;
+    HANDLE mmcss = AvSetMmThreadCharacteristicsW(L"Pro Audio", &mmcssTask);
+    if (!mmcss) std::cerr << "MMCSS registration failed, running at normal priority\n";
+
+    // Generate a dynamic file name with timestamp
+    std::string fileName = "recording_" + GetTimestamp() + ".wav";
+
+    UINT32 bufferFrames = 0;
+    pAudioClient->GetBufferSize(&bufferFrames); // no packet is larger
+    FormatStage formatStage;
+    if (!formatStage.init(pwfx->nChannels, pwfx->nSamplesPerSec, format, (uint32_t)outRate, dither, bufferFrames)) {
+        std::cerr << "Cannot resample " << pwfx->nSamplesPerSec << " Hz to " << outRate << " Hz\n"; return -1;
+    }
+
+    // Loopback of a 5.1/7.1 mix keeps its speaker layout
+    uint32_t channelMask = 0;
+    if (pwfx->wFormatTag == WAVE_FORMAT_EXTENSIBLE) {
+        channelMask = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(pwfx)->dwChannelMask;
+    }
+    WavStreamWriter writer;
+    if (!writer.open(fileName, pwfx->nChannels, formatStage.sampleRate(), formatStage.bitsPerSample(),
+                     formatStage.audioFormat(), channelMask)) {
+        std::cerr << "Failed to open " << fileName << "\n"; return -1;
+    }
+
+    // Enter is read on its own thread so the capture loop only wakes for
+    // audio or for the stop request. Started only once nothing else can
+    // fail: returning with it still joinable would abort the process.
+    HANDLE stopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    std::thread stdinThread([stopEvent] {
+        std::cin.get();
+        SetEvent(stopEvent);
+    });
+
+    std::cout << "Recording system audio. Press Enter to stop...\n";
+
+    bool recording = true;
+    HRESULT hr = S_OK; // a failure ends the recording without waiting for Enter
+
+    HANDLE waitHandles[2] = { stopEvent, audioEvent };
+    DWORD waitCount = eventDriven ? 2 : 1;
+    DWORD waitTimeout = eventDriven ? 200 : 10; // event mode: only reached when nothing is playing
+    while (recording && SUCCEEDED(hr)) {
+        // Drain once more after the stop request so the tail is kept
+        if (WaitForMultipleObjects(waitCount, waitHandles, FALSE, waitTimeout) == WAIT_OBJECT_0) recording = false;
+
+        UINT32 packetLength = 0;
+        hr = pCaptureClient->GetNextPacketSize(&packetLength);
+
+        while (SUCCEEDED(hr) && packetLength != 0) {
+            BYTE* pData;
+            UINT32 numFrames;
+            DWORD flags;
+
+            hr = pCaptureClient->GetBuffer(&pData, &numFrames, &flags, nullptr, nullptr);
+            if (FAILED(hr)) break;
+
+            // Silence is sized in the output format, not the mix format
+            formatStage.process((flags & AUDCLNT_BUFFERFLAGS_SILENT) ? nullptr : pData, numFrames, writer);
+
+            hr = pCaptureClient->ReleaseBuffer(numFrames);
+            if (SUCCEEDED(hr)) hr = pCaptureClient->GetNextPacketSize(&packetLength);
+        }
+    }
+
+    pAudioClient->Stop();
+    if (mmcss) AvRevertMmThreadCharacteristics(mmcss);
+    formatStage.finish(writer); // the resampler's delay line
+    writer.close(); // before anything that can block, so the header is patched
+
+    if (FAILED(hr)) {
+        // Device removed, format changed, ...: nobody has pressed Enter, so
+        // the stdin thread stays blocked in its read. It is left behind,
+        // with stopEvent still open for it, and ends with the process.
+        std::cerr << "Capture failed (0x" << std::hex << hr << std::dec << "), stopping\n";
+        std::cerr << "Kept what was recorded: " << fileName << "\n";
+        stdinThread.detach();
+    } else {
+        stdinThread.join(); // the loop only ends this way once Enter was read
+    }
+
+    CoTaskMemFree(pwfx);
+    if (pCaptureClient) pCaptureClient->Release();
+    if (pAudioClient) pAudioClient->Release();
+    if (pDevice) pDevice->Release();
+    if (pEnumerator) pEnumerator->Release();
+    CloseHandle(audioEvent);
+    if (SUCCEEDED(hr)) CloseHandle(stopEvent);
+    CoUninitialize();
+
+    if (FAILED(hr)) return -1;
+    std::cout << "Recording finished: " << fileName << "\n";
+    return 0;
+}
@@ -1,321 +1,4746 @@
-#include <windows.h>
-#include <dxgi1_2.h>
-#include <d3d11.h>
-#include <wrl/client.h>
-#include <iostream>
-#include <thread>
-#include <csignal>
-#include <chrono>
-#include <sstream>
-#include <iomanip>
-#include <queue>
-#include <mutex>
-#include <condition_variable>
-#include <vector>
-
-extern "C" {
-#include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-#include <libavutil/imgutils.h>
-#include <libavutil/opt.h>
-#include <libswscale/swscale.h>
-}
-
-#pragma comment(lib, "d3d11.lib")
-#pragma comment(lib, "dxgi.lib")
-
-using Microsoft::WRL::ComPtr;
-
-volatile bool stopRecording = false;
-void signalHandler(int) { stopRecording = true; }
-
-std::string getTimestampedFilename() {
-    auto now = std::chrono::system_clock::now();
-    auto timeT = std::chrono::system_clock::to_time_t(now);
-    std::tm tm;
-    localtime_s(&tm, &timeT);
-
-    std::ostringstream oss;
-    oss << "dxgi_output_"
-        << std::put_time(&tm, "%Y%m%d_%H%M%S") << ".avi";
-    return oss.str();
-}
-
-// --- Frame queue ---
-struct FrameItem {
-    AVFrame* frame;
-    int64_t pts;
-};
-
-class FrameQueue {
-public:
-    void push(FrameItem item) {
-        std::unique_lock<std::mutex> lock(mtx);
-        q.push(item);
-        cv.notify_one();
-    }
-
-    bool pop(FrameItem& item) {
-        std::unique_lock<std::mutex> lock(mtx);
-        while (q.empty() && !stopRecording) cv.wait(lock);
-        if (q.empty()) return false;
-        item = q.front();
-        q.pop();
-        return true;
-    }
-
-    bool empty() {
-        std::unique_lock<std::mutex> lock(mtx);
-        return q.empty();
-    }
-
-private:
-    std::queue<FrameItem> q;
-    std::mutex mtx;
-    std::condition_variable cv;
-};
-
-// --- Frame pool ---
-class FramePool {
-public:
-    FramePool(int size, int width, int height, AVPixelFormat pix_fmt) {
-        for (int i = 0; i < size; ++i) {
-            AVFrame* f = av_frame_alloc();
-            f->format = pix_fmt;
-            f->width = width;
-            f->height = height;
-            av_frame_get_buffer(f, 32); // allocate data buffers
-            freeFrames.push(f);
-        }
-    }
-
-    AVFrame* acquire() {
-        std::unique_lock<std::mutex> lock(mtx);
-        if (freeFrames.empty()) return nullptr;
-        AVFrame* f = freeFrames.front();
-        freeFrames.pop();
-        return f;
-    }
-
-    void release(AVFrame* f) {
-        // Do NOT unref buffer, just reset PTS
-        f->pts = 0;
-        std::unique_lock<std::mutex> lock(mtx);
-        freeFrames.push(f);
-    }
-
-private:
-    std::queue<AVFrame*> freeFrames;
-    std::mutex mtx;
-};
-
-int main() {
-    signal(SIGINT, signalHandler);
-
-    const int width = 1280;
-    const int height = 720;
-    const int targetFPS = 30;
-    std::string filename = getTimestampedFilename();
-
-    // --- 1. D3D11 device ---
-    ComPtr<ID3D11Device> device;
-    ComPtr<ID3D11DeviceContext> context;
-    D3D_FEATURE_LEVEL featureLevel;
-    if (FAILED(D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_HARDWARE, nullptr, 0,
-                                 nullptr, 0, D3D11_SDK_VERSION,
-                                 &device, &featureLevel, &context))) {
-        std::cerr << "Failed to create D3D11 device\n";
-        return -1;
-    }
-
-    // --- 2. DXGI duplication ---
-    ComPtr<IDXGIDevice> dxgiDevice;
-    device.As(&dxgiDevice);
-    ComPtr<IDXGIAdapter> adapter;
-    dxgiDevice->GetAdapter(&adapter);
-    ComPtr<IDXGIOutput> output;
-    adapter->EnumOutputs(0, &output);
-    ComPtr<IDXGIOutput1> output1;
-    output.As(&output1);
-    ComPtr<IDXGIOutputDuplication> duplication;
-    if (FAILED(output1->DuplicateOutput(device.Get(), &duplication))) {
-        std::cerr << "Failed to duplicate output\n";
-        return -1;
-    }
-
-    // --- 3. FFmpeg init ---
-    avformat_network_init();
-    AVFormatContext* outCtx = nullptr;
-    if (avformat_alloc_output_context2(&outCtx, nullptr, "avi", filename.c_str()) < 0) {
-        std::cerr << "Failed to allocate output context\n"; return -1;
-    }
-
-    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
-    if (!codec) { std::cerr << "H.264 codec not found\n"; return -1; }
-
-    AVCodecContext* codecCtx = avcodec_alloc_context3(codec);
-    codecCtx->width = width;
-    codecCtx->height = height;
-    codecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
-    codecCtx->bit_rate = 12 * 1000 * 1000; // 12 Mbps
-    codecCtx->rc_buffer_size = codecCtx->bit_rate;
-    codecCtx->rc_max_rate = codecCtx->bit_rate;
-    codecCtx->gop_size = 120; 
-    codecCtx->max_b_frames = 0;
-    codecCtx->time_base = {1, targetFPS};
-    codecCtx->thread_count = 1;
-    av_opt_set(codecCtx->priv_data, "preset", "ultrafast", 0);
-    av_opt_set(codecCtx->priv_data, "tune", "fastdecode", 0);
-    av_opt_set(codecCtx->priv_data, "profile", "main", 0);
-
-    AVStream* videoStream = avformat_new_stream(outCtx, codec);
-    if (!videoStream) { std::cerr << "Failed to create stream\n"; return -1; }
-    videoStream->time_base = codecCtx->time_base;
-
-    if (avcodec_open2(codecCtx, codec, nullptr) < 0) {
-        std::cerr << "Failed to open codec\n"; return -1;
-    }
-    avcodec_parameters_from_context(videoStream->codecpar, codecCtx);
-
-    if (!(outCtx->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&outCtx->pb, filename.c_str(), AVIO_FLAG_WRITE) < 0) {
-            std::cerr << "Failed to open output file\n"; return -1;
-        }
-    }
-
-    if (avformat_write_header(outCtx, nullptr) < 0) {
-        std::cerr << "Error writing header\n"; return -1;
-    }
-
-    // --- 4. SwsContext ---
-    SwsContext* swsCtx = sws_getContext(
-        width, height, AV_PIX_FMT_BGRA,
-        width, height, AV_PIX_FMT_YUV420P,
-        SWS_FAST_BILINEAR, nullptr, nullptr, nullptr
-    );
-
-    FrameQueue frameQueue;
-
-    // --- CPU staging texture ---
-    D3D11_TEXTURE2D_DESC cpuDesc = {};
-    cpuDesc.Width = width;
-    cpuDesc.Height = height;
-    cpuDesc.MipLevels = 1;
-    cpuDesc.ArraySize = 1;
-    cpuDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    cpuDesc.SampleDesc.Count = 1;
-    cpuDesc.Usage = D3D11_USAGE_STAGING;
-    cpuDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-    cpuDesc.BindFlags = 0;
-    cpuDesc.MiscFlags = 0;
-    ComPtr<ID3D11Texture2D> cpuTexture;
-    device->CreateTexture2D(&cpuDesc, nullptr, &cpuTexture);
-
-    // --- Frame pool ---
-    FramePool framePool(50, width, height, codecCtx->pix_fmt);
-
-    // --- 5. Encoder thread ---
-    std::thread encoderThread([&]() {
-        AVPacket pkt = {};
-        FrameItem item;
-        while (!stopRecording || !frameQueue.empty()) {
-            if (!frameQueue.pop(item)) continue;
-
-            if (avcodec_send_frame(codecCtx, item.frame) < 0) {
-                std::cerr << "Error sending frame to encoder\n";
-                break;
-            }
-
-            while (avcodec_receive_packet(codecCtx, &pkt) == 0) {
-                av_interleaved_write_frame(outCtx, &pkt);
-                av_packet_unref(&pkt);
-            }
-
-            framePool.release(item.frame);
-        }
-
-        // Flush encoder
-        while (avcodec_receive_packet(codecCtx, &pkt) == 0) {
-            av_interleaved_write_frame(outCtx, &pkt);
-            av_packet_unref(&pkt);
-        }
-    });
-
-    std::cout << "Recording... Ctrl+C to stop\n";
-
-    // --- 6. Capture loop ---
-    int64_t frameCounter = 0;
-    auto nextFrameTime = std::chrono::high_resolution_clock::now();
-    const auto frameInterval = std::chrono::milliseconds(1000 / targetFPS);
-
-    while (!stopRecording) {
-        auto now = std::chrono::high_resolution_clock::now();
-
-        if (now > nextFrameTime + frameInterval) {
-            int skipCount = std::chrono::duration_cast<std::chrono::milliseconds>(now - nextFrameTime).count() / frameInterval.count();
-            frameCounter += skipCount;
-            nextFrameTime += frameInterval * (skipCount + 1);
-        } else {
-            std::this_thread::sleep_until(nextFrameTime);
-            nextFrameTime += frameInterval;
-        }
-
-        ComPtr<IDXGIResource> desktopResource;
-        DXGI_OUTDUPL_FRAME_INFO frameInfo = {};
-        if (duplication->AcquireNextFrame(250, &frameInfo, &desktopResource) != S_OK) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            continue;
-        }
-
-        ComPtr<ID3D11Texture2D> frameTexture;
-        desktopResource.As(&frameTexture);
-
-        context->CopyResource(cpuTexture.Get(), frameTexture.Get());
-
-        D3D11_MAPPED_SUBRESOURCE mapped = {};
-        context->Map(cpuTexture.Get(), 0, D3D11_MAP_READ, 0, &mapped);
-
-        AVFrame* frameYUV = framePool.acquire();
-        if (!frameYUV) {
-            std::cerr << "Pool empty, skipping frame\n";
-            context->Unmap(cpuTexture.Get(), 0);
-            duplication->ReleaseFrame();
-            continue;
-        }
-
-        av_frame_make_writable(frameYUV);
-
-        uint8_t* srcData[1] = { (uint8_t*)mapped.pData };
-        int srcLinesize[1] = { (int)mapped.RowPitch };
-        sws_scale(swsCtx, srcData, srcLinesize, 0, height, frameYUV->data, frameYUV->linesize);
-
-int scaled = sws_scale(swsCtx, srcData, srcLinesize, 0, height, frameYUV->data, frameYUV->linesize);
-if (scaled <= 0) {
-    std::cerr << "sws_scale failed\n";
-    framePool.release(frameYUV);
-    context->Unmap(cpuTexture.Get(), 0);
-    duplication->ReleaseFrame();
-    continue;
-}
-
-
-
-
-        frameYUV->pts = frameCounter++;
-        frameQueue.push({ frameYUV, frameYUV->pts });
-
-        context->Unmap(cpuTexture.Get(), 0);
-        duplication->ReleaseFrame();
-    }
-
-    encoderThread.join();
-
-    av_write_trailer(outCtx);
-    sws_freeContext(swsCtx);
-    avcodec_free_context(&codecCtx);
-    if (!(outCtx->oformat->flags & AVFMT_NOFILE)) avio_close(outCtx->pb);
-    avformat_free_context(outCtx);
-
-    std::cout << "Recording finished: " << filename << "\n";
-    return 0;
-}
+#define NOMINMAX
+#include <windows.h>
+#include <dxgi1_2.h>
+#include <d3d11.h>
+#include <wrl/client.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
+#include <ksmedia.h>
+#include <avrt.h>
+#include <timeapi.h>
+#include <psapi.h>
+#include <iostream>
+#include <thread>
+#include <csignal>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <d3d10.h>
+#include <emmintrin.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/opt.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_d3d11va.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+}
+
+#pragma comment(lib, "d3d11.lib")
+#pragma comment(lib, "dxgi.lib")
+#pragma comment(lib, "synchronization.lib")
+#pragma comment(lib, "ole32.lib")
+#pragma comment(lib, "avrt.lib")
+#pragma comment(lib, "psapi.lib")
+#pragma comment(lib, "winmm.lib")
+
+using Microsoft::WRL::ComPtr;
+
+volatile bool stopRecording = false;
+void signalHandler(int) { stopRecording = true; }
+
+// Replay mode: Ctrl+Break saves the buffer (the CRT resets the handler on
+// every signal, so it re-arms itself)
+volatile bool replayDumpRequested = false;
+void replaySignalHandler(int sig) {
+    replayDumpRequested = true;
+    signal(sig, replaySignalHandler);
+}
+
+// Output name without extension; the muxer adds segment numbers and extension
+std::string getTimestampedBaseName() {
+    auto now = std::chrono::system_clock::now();
+    auto timeT = std::chrono::system_clock::to_time_t(now);
+    std::tm tm;
+    localtime_s(&tm, &timeT);
+
+    std::ostringstream oss;
+    oss << "dxgi_output_"
+        << std::put_time(&tm, "%Y%m%d_%H%M%S");
+    return oss.str();
+}
+
+// --- QPC clock ---
+int64_t qpcNow() {
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+
+int64_t qpcFrequency() {
+    static const int64_t freq = [] {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        return f.QuadPart;
+    }();
+    return freq;
+}
+
+// --- Thread scheduling ---
+// Where each kind of thread runs and how urgently, so pacing stays tight
+// while the recorder keeps out of the way of a heavy foreground app. Set
+// once from the options before the first pipeline starts; each thread
+// applies its role's policy itself.
+enum class ThreadRole { Capture, Encoder, Writer, Audio };
+
+struct ThreadPolicy {
+    DWORD_PTR cores[4] = {};   // per role, logical processors of group 0; 0 = the pipeline's block, or any
+    bool cpuSets = false;      // soft preference through CPU sets instead of a hard affinity mask
+    bool mmcssCapture = false; // capture threads join the MMCSS "Capture" task
+    bool ecoEncoder = false;   // encoder threads below normal priority and EcoQoS
+};
+
+ThreadPolicy threadPolicy;
+
+// "0-3,6" as a mask of those logical processors; false for an empty or
+// malformed list, or one naming a core that does not exist
+bool parseCoreList(const std::string& text, DWORD_PTR& mask) {
+    const int cores = std::min((int)sizeof(DWORD_PTR) * 8, std::max(1, (int)std::thread::hardware_concurrency()));
+    mask = 0;
+    std::stringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        char* end = nullptr;
+        long first = std::strtol(item.c_str(), &end, 10);
+        long last = first;
+        if (end != item.c_str() && *end == '-') last = std::strtol(end + 1, &end, 10);
+        if (end == item.c_str() || *end || first < 0 || last < first || last >= cores) return false;
+        for (long core = first; core <= last; ++core) mask |= (DWORD_PTR)1 << core;
+    }
+    return mask != 0;
+}
+
+// CPU set ids of the group 0 logical processors in mask
+std::vector<ULONG> cpuSetIds(DWORD_PTR mask) {
+    std::vector<ULONG> ids;
+    ULONG length = 0;
+    GetSystemCpuSetInformation(nullptr, 0, &length, GetCurrentProcess(), 0);
+    if (!length) return ids;
+    std::vector<char> buffer(length);
+    auto* info = reinterpret_cast<PSYSTEM_CPU_SET_INFORMATION>(buffer.data());
+    if (!GetSystemCpuSetInformation(info, length, &length, GetCurrentProcess(), 0)) return ids;
+    for (ULONG offset = 0; offset < length;) {
+        const auto* set = reinterpret_cast<const SYSTEM_CPU_SET_INFORMATION*>(buffer.data() + offset);
+        if (set->Type == CpuSetInformation && set->CpuSet.Group == 0 &&
+            set->CpuSet.LogicalProcessorIndex < sizeof(DWORD_PTR) * 8 &&
+            (mask >> set->CpuSet.LogicalProcessorIndex) & 1) {
+            ids.push_back(set->CpuSet.Id);
+        }
+        offset += set->Size;
+    }
+    return ids;
+}
+
+// Applies a role's policy to the calling thread for the lifetime of the
+// object. fallback (the pipeline's own block of cores) is used when the
+// role has no cores configured.
+class ScopedThreadPolicy {
+public:
+    explicit ScopedThreadPolicy(ThreadRole role, DWORD_PTR fallback = 0) {
+        HANDLE thread = GetCurrentThread();
+        DWORD_PTR mask = threadPolicy.cores[(int)role] ? threadPolicy.cores[(int)role] : fallback;
+        if (mask && threadPolicy.cpuSets) {
+            std::vector<ULONG> ids = cpuSetIds(mask);
+            if (ids.empty() || !SetThreadSelectedCpuSets(thread, ids.data(), (ULONG)ids.size())) {
+                SetThreadAffinityMask(thread, mask);
+            }
+        } else if (mask) {
+            SetThreadAffinityMask(thread, mask);
+        }
+        if (role == ThreadRole::Capture && threadPolicy.mmcssCapture) {
+            DWORD task = 0;
+            mmcss = AvSetMmThreadCharacteristicsW(L"Capture", &task);
+            if (mmcss) AvSetMmThreadPriority(mmcss, AVRT_PRIORITY_HIGH);
+        }
+        if (role == ThreadRole::Encoder && threadPolicy.ecoEncoder) {
+            SetThreadPriority(thread, THREAD_PRIORITY_BELOW_NORMAL);
+            THREAD_POWER_THROTTLING_STATE state = {};
+            state.Version = THREAD_POWER_THROTTLING_CURRENT_VERSION;
+            state.ControlMask = THREAD_POWER_THROTTLING_EXECUTION_SPEED;
+            state.StateMask = THREAD_POWER_THROTTLING_EXECUTION_SPEED;
+            SetThreadInformation(thread, ThreadPowerThrottling, &state, sizeof(state));
+        }
+    }
+
+    ~ScopedThreadPolicy() {
+        if (mmcss) AvRevertMmThreadCharacteristics(mmcss);
+    }
+
+    ScopedThreadPolicy(const ScopedThreadPolicy&) = delete;
+    ScopedThreadPolicy& operator=(const ScopedThreadPolicy&) = delete;
+
+private:
+    HANDLE mmcss = nullptr;
+};
+
+// Sleeps until a QPC deadline. A high-resolution waitable timer (Windows 10
+// 1803 and later) wakes within a fraction of a millisecond whatever the
+// system timer resolution; without one a plain waitable timer ticks at that
+// resolution. The last stretch before the deadline is spent yielding.
+class PacingTimer {
+public:
+    PacingTimer() {
+        timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        highResolution = timer != nullptr;
+        if (!timer) timer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+        margin = qpcFrequency() * (highResolution ? 200 : 1000) / 1000000;
+    }
+
+    ~PacingTimer() {
+        if (timer) CloseHandle(timer);
+    }
+
+    PacingTimer(const PacingTimer&) = delete;
+    PacingTimer& operator=(const PacingTimer&) = delete;
+
+    static bool highResolutionAvailable() {
+        HANDLE probe = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (probe) CloseHandle(probe);
+        return probe != nullptr;
+    }
+
+    void waitUntil(int64_t deadline) {
+        int64_t ticks = deadline - margin - qpcNow();
+        if (ticks > 0) sleep(ticks);
+        while (qpcNow() < deadline) std::this_thread::yield();
+    }
+
+    // Blocks for about this many QPC ticks, without the yielding tail
+    void sleep(int64_t ticks) {
+        LARGE_INTEGER due;
+        due.QuadPart = -std::max<int64_t>(1, ticks * 10000000 / qpcFrequency()); // relative, 100 ns units
+        if (timer && SetWaitableTimer(timer, &due, 0, nullptr, nullptr, FALSE)) {
+            WaitForSingleObject(timer, INFINITE);
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(ticks * 1000000 / qpcFrequency()));
+        }
+    }
+
+private:
+    HANDLE timer = nullptr;
+    bool highResolution = false;
+    int64_t margin = 0; // QPC ticks yielded rather than slept
+};
+
+// --- Stage timers ---
+// Per-stage cost of the capture pipeline, printed every few seconds so a
+// regression (say, converting a frame twice) shows up as a number. Stages
+// are timed on the capture thread and the convert stage, hence atomics.
+enum Stage { STAGE_ACQUIRE, STAGE_COPY, STAGE_MAP, STAGE_CONVERT, STAGE_ENQUEUE, STAGE_COUNT };
+
+class StageTimers {
+public:
+    explicit StageTimers(int reportSeconds, const std::string& label = "")
+        : label(label), reportTicks(reportSeconds * qpcFrequency()) {
+        windowStart = qpcNow();
+    }
+
+    void add(Stage stage, int64_t ticks) {
+        total[stage].fetch_add(ticks, std::memory_order_relaxed);
+        int64_t seen = peak[stage].load(std::memory_order_relaxed);
+        while (ticks > seen && !peak[stage].compare_exchange_weak(seen, ticks, std::memory_order_relaxed)) {}
+        count[stage].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // True if a summary was printed
+    bool reportIfDue() {
+        int64_t now = qpcNow();
+        if (now - windowStart < reportTicks) return false;
+
+        static const char* names[STAGE_COUNT] = { "acquire", "copy", "map", "convert", "enqueue" };
+        double msPerTick = 1000.0 / qpcFrequency();
+        std::ostringstream oss;
+        oss << std::fixed << std::setprecision(2) << "[" << (label.empty() ? "" : label + " ") << "stages avg/max ms]";
+        int64_t enqueued = 0;
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            int64_t n = count[i].exchange(0, std::memory_order_relaxed);
+            int64_t sum = total[i].exchange(0, std::memory_order_relaxed);
+            int64_t max = peak[i].exchange(0, std::memory_order_relaxed);
+            double avg = n ? sum * msPerTick / n : 0.0;
+            oss << " " << names[i] << " " << avg << "/" << max * msPerTick;
+            if (i == STAGE_ENQUEUE) enqueued = n;
+        }
+        oss << " | " << enqueued * (double)qpcFrequency() / (now - windowStart) << " fps\n";
+        std::cout << oss.str();
+
+        windowStart = now;
+        return true;
+    }
+
+private:
+    std::atomic<int64_t> total[STAGE_COUNT] = {};
+    std::atomic<int64_t> peak[STAGE_COUNT] = {};
+    std::atomic<int64_t> count[STAGE_COUNT] = {};
+    std::string label;
+    int64_t windowStart;
+    int64_t reportTicks;
+};
+
+// --- Lock-free SPSC ring ---
+// Bounded single-producer/single-consumer ring of pre-allocated slots. Each
+// end is owned by one thread, so a handoff is two atomic index updates with
+// no lock and no allocation. An empty ring is waited on by spinning,
+// yielding, or sleeping in WaitOnAddress; producers only wake a consumer
+// that is actually asleep.
+enum class WaitStrategy { Spin, Yield, Futex };
+
+template <typename T>
+class SpscRing {
+public:
+    SpscRing(uint32_t minCapacity, WaitStrategy strategy) : strategy(strategy) {
+        uint32_t capacity = 1;
+        while (capacity < minCapacity) capacity <<= 1;
+        slots.resize(capacity);
+        mask = capacity - 1;
+    }
+
+    // Producer side; false if the ring is full
+    bool push(const T& item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - cachedTail > mask) {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h - cachedTail > mask) return false;
+        }
+        slots[h & mask] = item;
+        head.store(h + 1, std::memory_order_seq_cst);
+        if (consumerWaiting.load(std::memory_order_seq_cst)) WakeByAddressSingle((void*)&head);
+        return true;
+    }
+
+    // Consumer side; false if the ring is empty
+    bool tryPop(T& item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == cachedHead) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t == cachedHead) return false;
+        }
+        item = slots[t & mask];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side; waits up to timeoutMs (forever if negative). Returns
+    // false on timeout, or once the ring is closed and drained.
+    bool pop(T& item, int timeoutMs = -1) {
+        int64_t deadline = timeoutMs < 0 ? INT64_MAX : qpcNow() + timeoutMs * qpcFrequency() / 1000;
+        for (uint32_t spins = 0;; ++spins) {
+            if (tryPop(item)) return true;
+            if (closed.load(std::memory_order_acquire)) return tryPop(item);
+            if (qpcNow() >= deadline) return false;
+            waitForPush(spins);
+        }
+    }
+
+    // No more pushes; pop() drains what is left and then returns false
+    void close() {
+        closed.store(true, std::memory_order_seq_cst);
+        WakeByAddressAll((void*)&head);
+    }
+
+    bool empty() const { return size() == 0; }
+    uint32_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+    uint32_t capacity() const { return mask + 1; }
+
+private:
+    void waitForPush(uint32_t spins) {
+        if (strategy == WaitStrategy::Spin || spins < 64) {
+            YieldProcessor();
+        } else if (strategy == WaitStrategy::Yield) {
+            std::this_thread::yield();
+        } else {
+            // Sleep until head moves; the short timeout bounds how late a
+            // close() or a pop() deadline can be noticed
+            uint32_t t = tail.load(std::memory_order_relaxed);
+            consumerWaiting.store(true, std::memory_order_seq_cst);
+            if (head.load(std::memory_order_seq_cst) == t && !closed.load(std::memory_order_acquire)) {
+                WaitOnAddress((volatile void*)&head, &t, sizeof(t), 10);
+            }
+            consumerWaiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // Producer and consumer state on separate cache lines
+    alignas(64) std::atomic<uint32_t> head{0};
+    uint32_t cachedTail = 0;
+    alignas(64) std::atomic<uint32_t> tail{0};
+    uint32_t cachedHead = 0;
+    std::atomic<bool> consumerWaiting{false};
+    alignas(64) std::atomic<bool> closed{false};
+    std::vector<T> slots;
+    uint32_t mask;
+    WaitStrategy strategy;
+};
+
+// --- Frame queue ---
+struct FrameItem {
+    AVFrame* frame;
+    int64_t pts;
+};
+
+// Capture thread -> encoder thread
+typedef SpscRing<FrameItem> FrameQueue;
+
+// --- Frame arena ---
+// The planes of every pool frame are carved out of one VirtualAlloc block
+// instead of a heap allocation each: rows are 64-byte aligned (an AVX-512
+// load), and every page is touched up front so no page fault lands in the
+// capture loop. "locked" pins the block in RAM; "large" maps it on large
+// pages, which needs SeLockMemoryPrivilege and is never paged out either.
+// Each plane's AVBufferRef holds a reference on the block, so it is freed
+// with the last frame.
+struct FrameLayout {
+    static const int kAlign = 64;
+    int linesize[4] = {};
+    size_t planeBytes[4] = {};
+    size_t frameBytes = 0;
+
+    bool init(int width, int height, AVPixelFormat pixFmt) {
+        if (av_image_fill_linesizes(linesize, pixFmt, width) < 0) return false;
+        ptrdiff_t strides[4] = {};
+        for (int i = 0; i < 4; ++i) {
+            linesize[i] = (linesize[i] + kAlign - 1) & ~(kAlign - 1);
+            strides[i] = linesize[i];
+        }
+        if (av_image_fill_plane_sizes(planeBytes, pixFmt, height, strides) < 0) return false;
+        for (int i = 0; i < 4; ++i) {
+            if (!planeBytes[i]) continue;
+            // Same tail padding as av_frame_get_buffer, for SIMD overreads
+            planeBytes[i] = (planeBytes[i] + kAlign + kAlign - 1) & ~(size_t)(kAlign - 1);
+            frameBytes += planeBytes[i];
+        }
+        return true;
+    }
+};
+
+bool enableLockMemoryPrivilege() {
+    HANDLE token = nullptr;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) return false;
+    TOKEN_PRIVILEGES privileges = {};
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool ok = LookupPrivilegeValueA(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+              AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+              GetLastError() != ERROR_NOT_ALL_ASSIGNED; // not granted to this account
+    CloseHandle(token);
+    return ok;
+}
+
+void freeArena(void*, uint8_t* data) { VirtualFree(data, 0, MEM_RELEASE); }
+void unrefArena(void* opaque, uint8_t*) {
+    AVBufferRef* arena = (AVBufferRef*)opaque;
+    av_buffer_unref(&arena);
+}
+
+// pages is "normal", "locked" or "large"; falls back towards "normal" with
+// a message. Sets how the block ended up being backed.
+AVBufferRef* allocArena(size_t bytes, const std::string& pages, std::string& backing) {
+    uint8_t* data = nullptr;
+    if (pages == "large") {
+        size_t largePage = GetLargePageMinimum();
+        size_t rounded = largePage ? (bytes + largePage - 1) / largePage * largePage : 0;
+        if (largePage && enableLockMemoryPrivilege()) {
+            data = (uint8_t*)VirtualAlloc(nullptr, rounded, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+        }
+        if (data) {
+            bytes = rounded;
+            backing = "large pages";
+        } else {
+            std::cerr << "Large pages unavailable (SeLockMemoryPrivilege, or memory too fragmented), using normal pages\n";
+        }
+    }
+    if (!data) {
+        data = (uint8_t*)VirtualAlloc(nullptr, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!data) return nullptr;
+        backing = "normal pages";
+        for (size_t i = 0; i < bytes; i += 4096) data[i] = 0; // fault every page in now
+    }
+    if (pages == "locked" && backing == "normal pages") {
+        // VirtualLock is capped by the working set minimum; grow it first
+        SIZE_T minimum = 0, maximum = 0;
+        GetProcessWorkingSetSize(GetCurrentProcess(), &minimum, &maximum);
+        SetProcessWorkingSetSize(GetCurrentProcess(), minimum + bytes, std::max(maximum, minimum + bytes));
+        if (VirtualLock(data, bytes)) backing = "locked pages";
+        else std::cerr << "Pool memory could not be locked, leaving it pageable\n";
+    }
+    AVBufferRef* arena = av_buffer_create(data, bytes, freeArena, nullptr, 0);
+    if (!arena) VirtualFree(data, 0, MEM_RELEASE);
+    return arena;
+}
+
+// --- Frame pool ---
+// Free frames travel back encoder thread -> capture thread through their own
+// SPSC ring; only the capture thread acquires and only the encoder releases.
+class FramePool {
+public:
+    // With hwFrames set, frames come from FFmpeg's D3D11 texture pool instead,
+    // created with the same size. pages picks the arena's backing (see allocArena)
+    FramePool(int size, int width, int height, AVPixelFormat pix_fmt, WaitStrategy wait,
+              AVBufferRef* hwFrames = nullptr, const std::string& pages = "normal")
+        : freeFrames(size, wait), hwFramesCtx(hwFrames) {
+        if (hwFramesCtx) return;
+        spare.reserve(size);
+        FrameLayout layout;
+        AVBufferRef* arena = layout.init(width, height, pix_fmt) ?
+            allocArena(layout.frameBytes * size, pages, backing) : nullptr;
+        if (arena) arenaBytes = arena->size;
+        for (int i = 0; i < size; ++i) {
+            AVFrame* f = av_frame_alloc();
+            f->format = pix_fmt;
+            f->width = width;
+            f->height = height;
+            if (!arena || !carve(f, arena, layout, i * layout.frameBytes)) {
+                av_frame_get_buffer(f, 32); // separate heap buffers
+            }
+            freeFrames.push(f);
+        }
+        av_buffer_unref(&arena); // the frames hold it now
+    }
+
+    // Capture thread, once the encoder has returned its frames
+    ~FramePool() {
+        AVFrame* f = nullptr;
+        while (freeFrames.tryPop(f)) av_frame_free(&f);
+        for (AVFrame* frame : spare) av_frame_free(&frame);
+    }
+
+    // 0 when the frames are on the heap or on the GPU
+    size_t memoryBytes() const { return arenaBytes; }
+    const std::string& memoryBacking() const { return backing; }
+
+    // Capture thread; waits up to timeoutMs for a frame to come back
+    AVFrame* acquire(int timeoutMs = 0) {
+        if (hwFramesCtx) {
+            int64_t deadline = qpcNow() + timeoutMs * qpcFrequency() / 1000;
+            AVFrame* f = av_frame_alloc();
+            while (av_hwframe_get_buffer(hwFramesCtx, f, 0) < 0) {
+                if (qpcNow() >= deadline) {
+                    av_frame_free(&f); // texture pool exhausted
+                    return nullptr;
+                }
+                Sleep(1);
+            }
+            return f;
+        }
+        AVFrame* f = nullptr;
+        if (!spare.empty()) {
+            f = spare.back();
+            spare.pop_back();
+            return f;
+        }
+        if (timeoutMs > 0) return freeFrames.pop(f, timeoutMs) ? f : nullptr;
+        return freeFrames.tryPop(f) ? f : nullptr;
+    }
+
+    // Capture thread: a frame from acquire() that never reached the queue.
+    // Kept on this side so the free ring keeps a single producer.
+    void putBack(AVFrame* f) {
+        if (hwFramesCtx) {
+            av_frame_free(&f);
+            return;
+        }
+        spare.push_back(f);
+    }
+
+    // Encoder thread
+    void release(AVFrame* f) {
+        // Hardware encoders may still reference the texture after
+        // receive_packet, so hw frames go back to FFmpeg's pool by refcount
+        if (hwFramesCtx) {
+            av_frame_free(&f);
+            return;
+        }
+        // Do NOT unref buffer, just reset PTS
+        f->pts = 0;
+        freeFrames.push(f);
+    }
+
+private:
+    static bool carve(AVFrame* f, AVBufferRef* arena, const FrameLayout& layout, size_t offset) {
+        for (int i = 0; i < 4 && layout.planeBytes[i]; ++i) {
+            AVBufferRef* ref = av_buffer_ref(arena);
+            if (!ref) return false;
+            f->buf[i] = av_buffer_create(arena->data + offset, layout.planeBytes[i], unrefArena, ref, 0);
+            if (!f->buf[i]) {
+                av_buffer_unref(&ref);
+                return false;
+            }
+            f->data[i] = f->buf[i]->data;
+            f->linesize[i] = layout.linesize[i];
+            offset += layout.planeBytes[i];
+        }
+        f->extended_data = f->data;
+        return true;
+    }
+
+    SpscRing<AVFrame*> freeFrames;
+    std::vector<AVFrame*> spare;
+    AVBufferRef* hwFramesCtx = nullptr;
+    size_t arenaBytes = 0;
+    std::string backing;
+};
+
+// --- Backpressure ---
+// What the capture side does when every pool frame is still queued or being
+// encoded. Drops are counted instead of logged, and PTS always follow the
+// wall clock, so a slow encoder thins the video out instead of shortening it.
+enum class Backpressure { DropNewest, DropOldest, Duplicate, Block };
+
+struct DropStats {
+    std::atomic<uint64_t> poolEmpty{0};     // captures that found no free frame
+    std::atomic<uint64_t> droppedNewest{0}; // captures thrown away
+    std::atomic<uint64_t> droppedOldest{0}; // queued frames discarded unencoded
+    std::atomic<uint64_t> duplicated{0};    // repeats of the last frame sent instead
+    std::atomic<uint64_t> blockTimeouts{0}; // blocking waits that ran out
+    std::atomic<uint64_t> unchanged{0};     // captures identical to the last frame
+
+    void print(const char* label) const {
+        std::cout << "[" << label << "] pool empty " << poolEmpty
+                  << ", dropped newest " << droppedNewest
+                  << ", dropped oldest " << droppedOldest
+                  << ", duplicated " << duplicated
+                  << ", block timeouts " << blockTimeouts
+                  << ", unchanged " << unchanged << "\n";
+    }
+};
+
+// --- Telemetry ---
+// Live counters in a named shared-memory block (Local\<name>), so a monitor
+// can tell whether a recorder keeps up without asking it. Every field is an
+// aligned 64-bit value stored with relaxed atomics by the one thread that
+// owns it; a reader may see one field a frame ahead of another, never a
+// torn value. Any layout change bumps kVersion.
+struct TelemetryCounters {
+    // Capture thread
+    std::atomic<int64_t> captured{0};        // frames acquired from DXGI
+    std::atomic<int64_t> dropped{0};         // frames lost to backpressure, newest and oldest
+    std::atomic<int64_t> poolEmpty{0};       // captures that found no free frame
+    std::atomic<int64_t> acquireTimeouts{0}; // AcquireNextFrame calls with nothing new
+    std::atomic<int64_t> queueDepth{0};      // frames waiting for the encoder
+    std::atomic<int64_t> updatedMs{0};       // GetTickCount64() at the last capture iteration
+    std::atomic<int64_t> recoveries{0};      // duplications recreated after losing access
+    std::atomic<int64_t> lostMsTotal{0};     // time spent without a duplication
+    // Encoder thread
+    std::atomic<int64_t> encoded{0};         // frames sent to the encoder
+    std::atomic<int64_t> encodeUsLast{0};    // send + receive time of the last frame
+    std::atomic<int64_t> encodeUsTotal{0};
+    std::atomic<int64_t> bytes{0};           // encoded video handed to the muxer
+    std::atomic<int64_t> bitrate{0};         // achieved over the last second, bit/s
+    std::atomic<int64_t> bitrateTarget{0};   // what the encoder was asked for, bit/s
+    char label[16] = {};
+};
+
+struct TelemetryBlock {
+    static const uint32_t kMagic = 0x54525844; // "DXRT"
+    static const uint32_t kVersion = 2;
+    static const int kMaxPipelines = 8;
+    std::atomic<uint32_t> magic{0}; // set last, once the header is filled in
+    uint32_t version = 0;
+    uint32_t pipelines = 0;
+    uint32_t pid = 0;
+    TelemetryCounters pipeline[kMaxPipelines];
+};
+
+class Telemetry {
+public:
+    ~Telemetry() {
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+    }
+
+    // Without a name the counters are kept in process memory only, so the
+    // hot path updates them the same way either way
+    bool open(const std::string& name, int pipelines) {
+        if (!name.empty()) {
+            std::string path = "Local\\" + name;
+            mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0,
+                                         sizeof(TelemetryBlock), path.c_str());
+            if (mapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+                std::cerr << "Telemetry block " << path << " is already in use\n";
+                return false;
+            }
+            if (mapping) view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, sizeof(TelemetryBlock));
+            if (!view) {
+                std::cerr << "Failed to create telemetry block " << path << "\n";
+                return false;
+            }
+            block = new (view) TelemetryBlock();
+        } else {
+            local.reset(new TelemetryBlock());
+            block = local.get();
+        }
+        block->version = TelemetryBlock::kVersion;
+        block->pipelines = (uint32_t)std::min(pipelines, TelemetryBlock::kMaxPipelines);
+        block->pid = GetCurrentProcessId();
+        block->magic.store(TelemetryBlock::kMagic, std::memory_order_release);
+        return true;
+    }
+
+    // Pipelines past kMaxPipelines share counters nobody reads
+    TelemetryCounters& pipeline(int index) {
+        return index < TelemetryBlock::kMaxPipelines ? block->pipeline[index] : overflow;
+    }
+
+private:
+    HANDLE mapping = nullptr;
+    void* view = nullptr;
+    std::unique_ptr<TelemetryBlock> local;
+    TelemetryBlock* block = nullptr;
+    TelemetryCounters overflow;
+};
+
+// Prints another recorder's block in Prometheus text format, for a
+// node_exporter textfile collector or a quick look
+bool printTelemetry(const std::string& name) {
+    std::string path = "Local\\" + name;
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, path.c_str());
+    const TelemetryBlock* block = mapping ?
+        (const TelemetryBlock*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(TelemetryBlock)) : nullptr;
+    if (!block || block->magic.load(std::memory_order_acquire) != TelemetryBlock::kMagic ||
+        block->version != TelemetryBlock::kVersion) {
+        std::cerr << "No recorder telemetry at " << path << "\n";
+        if (block) UnmapViewOfFile(block);
+        if (mapping) CloseHandle(mapping);
+        return false;
+    }
+
+    struct Metric {
+        const char* name;
+        const char* type;
+        std::function<double(const TelemetryCounters&)> value;
+    };
+    const int64_t nowMs = (int64_t)GetTickCount64();
+    const Metric metrics[] = {
+        { "captured_frames_total", "counter", [](const TelemetryCounters& c) { return (double)c.captured.load(); } },
+        { "dropped_frames_total", "counter", [](const TelemetryCounters& c) { return (double)c.dropped.load(); } },
+        { "pool_empty_total", "counter", [](const TelemetryCounters& c) { return (double)c.poolEmpty.load(); } },
+        { "acquire_timeouts_total", "counter", [](const TelemetryCounters& c) { return (double)c.acquireTimeouts.load(); } },
+        { "queue_depth", "gauge", [](const TelemetryCounters& c) { return (double)c.queueDepth.load(); } },
+        { "encoded_frames_total", "counter", [](const TelemetryCounters& c) { return (double)c.encoded.load(); } },
+        { "encode_seconds_last", "gauge", [](const TelemetryCounters& c) { return c.encodeUsLast.load() / 1e6; } },
+        { "encode_seconds_total", "counter", [](const TelemetryCounters& c) { return c.encodeUsTotal.load() / 1e6; } },
+        { "video_bytes_total", "counter", [](const TelemetryCounters& c) { return (double)c.bytes.load(); } },
+        { "bitrate_bps", "gauge", [](const TelemetryCounters& c) { return (double)c.bitrate.load(); } },
+        { "bitrate_target_bps", "gauge", [](const TelemetryCounters& c) { return (double)c.bitrateTarget.load(); } },
+        { "duplication_recoveries_total", "counter", [](const TelemetryCounters& c) { return (double)c.recoveries.load(); } },
+        { "duplication_lost_seconds_total", "counter", [](const TelemetryCounters& c) { return c.lostMsTotal.load() / 1e3; } },
+        { "capture_age_seconds", "gauge", [nowMs](const TelemetryCounters& c) { return (nowMs - c.updatedMs.load()) / 1e3; } },
+    };
+    std::ostringstream oss;
+    for (const Metric& m : metrics) {
+        oss << "# TYPE dxgi_recorder_" << m.name << " " << m.type << "\n";
+        for (uint32_t i = 0; i < block->pipelines; ++i) {
+            const TelemetryCounters& c = block->pipeline[i];
+            oss << "dxgi_recorder_" << m.name << "{pid=\"" << block->pid << "\",pipeline=\""
+                << std::string(c.label, strnlen(c.label, sizeof(c.label))) << "\"} " << m.value(c) << "\n";
+        }
+    }
+    std::cout << oss.str();
+    UnmapViewOfFile(block);
+    CloseHandle(mapping);
+    return true;
+}
+
+// --- Desktop outputs ---
+// Every output of every adapter in DXGI order; the command line picks them
+// as adapter:output, the same numbers --list-outputs prints
+struct DisplayOutput {
+    int adapterIndex = 0;
+    int outputIndex = 0;
+    ComPtr<IDXGIAdapter1> adapter;
+    ComPtr<IDXGIOutput1> output;
+    DXGI_OUTPUT_DESC desc = {};
+    std::string adapterName;
+    std::string deviceName; // \\.\DISPLAYn
+};
+
+std::string narrow(const WCHAR* text) {
+    char buffer[256];
+    int n = WideCharToMultiByte(CP_UTF8, 0, text, -1, buffer, sizeof(buffer), nullptr, nullptr);
+    return n > 0 ? std::string(buffer, n - 1) : std::string();
+}
+
+std::vector<DisplayOutput> enumerateOutputs() {
+    std::vector<DisplayOutput> outputs;
+    ComPtr<IDXGIFactory1> factory;
+    if (FAILED(CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void**)&factory))) return outputs;
+    ComPtr<IDXGIAdapter1> adapter;
+    for (UINT a = 0; factory->EnumAdapters1(a, &adapter) != DXGI_ERROR_NOT_FOUND; ++a) {
+        DXGI_ADAPTER_DESC1 adapterDesc = {};
+        adapter->GetDesc1(&adapterDesc);
+        ComPtr<IDXGIOutput> output;
+        for (UINT o = 0; adapter->EnumOutputs(o, &output) != DXGI_ERROR_NOT_FOUND; ++o) {
+            DisplayOutput d;
+            d.adapterIndex = (int)a;
+            d.outputIndex = (int)o;
+            d.adapter = adapter;
+            if (FAILED(output.As(&d.output))) continue;
+            output->GetDesc(&d.desc);
+            d.adapterName = narrow(adapterDesc.Description);
+            d.deviceName = narrow(d.desc.DeviceName);
+            outputs.push_back(d);
+        }
+    }
+    return outputs;
+}
+
+// "0:0,0:1,1:0" or "all"; false with a message for anything that does not
+// name an attached output, or names one twice
+bool selectOutputs(const std::string& spec, const std::vector<DisplayOutput>& all,
+                   std::vector<DisplayOutput>& selected) {
+    selected.clear();
+    if (spec == "all") {
+        for (const DisplayOutput& d : all) {
+            if (d.desc.AttachedToDesktop) selected.push_back(d);
+        }
+        if (selected.empty()) std::cerr << "No attached outputs found\n";
+        return !selected.empty();
+    }
+    std::istringstream list(spec);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        int a = -1, o = -1;
+        char extra;
+        if (std::sscanf(item.c_str(), "%d:%d%c", &a, &o, &extra) != 2) {
+            std::cerr << "--outputs entries look like 0:1 (adapter:output), got " << item << "\n";
+            return false;
+        }
+        auto match = [&](const DisplayOutput& d) { return d.adapterIndex == a && d.outputIndex == o; };
+        auto it = std::find_if(all.begin(), all.end(), match);
+        if (it == all.end() || !it->desc.AttachedToDesktop) {
+            std::cerr << "No attached output " << a << ":" << o << " (see --list-outputs)\n";
+            return false;
+        }
+        if (std::any_of(selected.begin(), selected.end(), match)) {
+            std::cerr << "Output " << a << ":" << o << " selected twice\n";
+            return false;
+        }
+        selected.push_back(*it);
+    }
+    if (selected.empty()) std::cerr << "--outputs selects nothing\n";
+    return !selected.empty();
+}
+
+// --- Mouse pointer ---
+// The duplicated desktop never contains the pointer; DXGI reports it on the
+// side. Position and visibility come with mouse updates, the shape only when
+// it changes (PointerShapeBufferSize > 0), so it is cached here.
+struct PointerState {
+    bool visible = false;
+    int x = 0, y = 0;          // top-left of the shape in capture coordinates
+    DXGI_OUTDUPL_POINTER_SHAPE_INFO shapeInfo = {};
+    std::vector<BYTE> shape;   // as GetFramePointerShape returns it
+    uint64_t version = 0;      // bumped on any change
+    uint64_t shapeVersion = 0; // bumped when the shape changes
+};
+
+// --- Desktop source ---
+// What the capture loop acquires from. One output is handed through as-is.
+// Several outputs on one adapter are composited into one texture laid out
+// as on the desktop: each new frame is copied into its place and released
+// straight away, so the rest of the pipeline sees one output the size of
+// their bounding box.
+class DesktopSource {
+public:
+    bool init(ID3D11Device* device, ID3D11DeviceContext* context, const std::vector<DisplayOutput>& outputs) {
+        this->device = device;
+        this->context = context;
+        this->outputs = outputs;
+        return duplicate(true) == S_OK;
+    }
+
+    // Drops the current duplications and creates them again, as needed after
+    // DXGI_ERROR_ACCESS_LOST (mode change, secure desktop, fullscreen switch).
+    // The size may differ afterwards. Failures only print when verbose.
+    HRESULT duplicate(bool verbose) {
+        sources.clear(); // an output allows one duplication per process
+        for (const DisplayOutput& d : outputs) {
+            Source source;
+            HRESULT hr = d.output->DuplicateOutput(device, &source.duplication);
+            if (FAILED(hr)) {
+                if (verbose) std::cerr << "Failed to duplicate output " << d.adapterIndex << ":" << d.outputIndex << "\n";
+                sources.clear();
+                return hr;
+            }
+            DXGI_OUTDUPL_DESC duplDesc = {};
+            source.duplication->GetDesc(&duplDesc);
+            if (outputs.size() > 1 && duplDesc.Rotation != DXGI_MODE_ROTATION_IDENTITY &&
+                duplDesc.Rotation != DXGI_MODE_ROTATION_UNSPECIFIED) {
+                // The desktop image comes unrotated; placing it would need a rotating blit
+                std::cerr << "Output " << d.adapterIndex << ":" << d.outputIndex << " is rotated and cannot be composited\n";
+                sources.clear();
+                return DXGI_ERROR_UNSUPPORTED;
+            }
+            // Composite positions are made relative to the bounding box below
+            source.x = outputs.size() > 1 ? d.desc.DesktopCoordinates.left : 0;
+            source.y = outputs.size() > 1 ? d.desc.DesktopCoordinates.top : 0;
+            source.width = (int)duplDesc.ModeDesc.Width;
+            source.height = (int)duplDesc.ModeDesc.Height;
+            sources.push_back(source);
+        }
+        if (sources.size() == 1) {
+            compositeWidth = sources[0].width;
+            compositeHeight = sources[0].height;
+            return S_OK;
+        }
+
+        int left = sources[0].x, top = sources[0].y, right = left, bottom = top;
+        for (const Source& s : sources) {
+            left = std::min(left, s.x);
+            top = std::min(top, s.y);
+            right = std::max(right, s.x + s.width);
+            bottom = std::max(bottom, s.y + s.height);
+        }
+        for (Source& s : sources) {
+            s.x -= left;
+            s.y -= top;
+        }
+        if (composite && compositeWidth == right - left && compositeHeight == bottom - top) return S_OK;
+        compositeWidth = right - left;
+        compositeHeight = bottom - top;
+        composite.Reset();
+
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = compositeWidth;
+        desc.Height = compositeHeight;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        HRESULT hr = device->CreateTexture2D(&desc, nullptr, &composite);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to create composite texture\n";
+            sources.clear();
+            return hr;
+        }
+        return S_OK;
+    }
+
+    // S_OK with the desktop texture, which stays valid until release();
+    // otherwise the duplication's error, DXGI_ERROR_WAIT_TIMEOUT when
+    // nothing changed
+    HRESULT acquire(UINT timeoutMs, DXGI_OUTDUPL_FRAME_INFO& frameInfo, ComPtr<ID3D11Texture2D>& texture) {
+        if (!composite) {
+            ComPtr<IDXGIResource> resource;
+            HRESULT hr = sources[0].duplication->AcquireNextFrame(timeoutMs, &frameInfo, &resource);
+            if (hr == S_OK) {
+                resource.As(&texture);
+                updatePointer(0, frameInfo);
+            }
+            return hr;
+        }
+
+        // Outputs are polled rather than waited on, so a static one does not
+        // hold up the others. The composite presents when its latest output did.
+        const int64_t deadline = qpcNow() + timeoutMs * qpcFrequency() / 1000;
+        for (;;) {
+            frameInfo = {};
+            bool updated = false;
+            for (Source& s : sources) {
+                DXGI_OUTDUPL_FRAME_INFO info = {};
+                ComPtr<IDXGIResource> resource;
+                HRESULT hr = s.duplication->AcquireNextFrame(0, &info, &resource);
+                if (hr == DXGI_ERROR_WAIT_TIMEOUT) continue;
+                if (FAILED(hr)) return hr;
+                updatePointer(&s - sources.data(), info);
+                frameInfo.LastMouseUpdateTime.QuadPart = std::max(frameInfo.LastMouseUpdateTime.QuadPart,
+                                                                  info.LastMouseUpdateTime.QuadPart);
+                if (info.LastPresentTime.QuadPart != 0) {
+                    ComPtr<ID3D11Texture2D> frame;
+                    resource.As(&frame);
+                    context->CopySubresourceRegion(composite.Get(), 0, s.x, s.y, 0, frame.Get(), 0, nullptr);
+                    frameInfo.LastPresentTime.QuadPart = std::max(frameInfo.LastPresentTime.QuadPart,
+                                                                  info.LastPresentTime.QuadPart);
+                }
+                frameInfo.AccumulatedFrames += info.AccumulatedFrames;
+                s.duplication->ReleaseFrame();
+                updated = true;
+            }
+            if (updated) {
+                texture = composite;
+                return S_OK;
+            }
+            if (qpcNow() >= deadline) return DXGI_ERROR_WAIT_TIMEOUT;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    void release() {
+        if (!composite) sources[0].duplication->ReleaseFrame();
+    }
+
+    // The single output's duplication, for its dirty rects; nullptr when compositing
+    IDXGIOutputDuplication* duplication() { return composite ? nullptr : sources[0].duplication.Get(); }
+    // Where the pointer is as of the last acquired frame
+    const PointerState& pointer() const { return pointerState; }
+    int width() const { return compositeWidth; }
+    int height() const { return compositeHeight; }
+
+private:
+    struct Source {
+        ComPtr<IDXGIOutputDuplication> duplication;
+        int x = 0, y = 0; // position in the composite
+        int width = 0, height = 0;
+    };
+
+    // Called while the output's frame is still held, as the shape must be
+    void updatePointer(size_t index, const DXGI_OUTDUPL_FRAME_INFO& info) {
+        Source& s = sources[index];
+        if (info.LastMouseUpdateTime.QuadPart != 0) {
+            // An output the pointer is not on reports it invisible; only the
+            // one it was last seen on may hide it
+            if (info.PointerPosition.Visible) {
+                pointerState.visible = true;
+                pointerState.x = s.x + info.PointerPosition.Position.x;
+                pointerState.y = s.y + info.PointerPosition.Position.y;
+                pointerOutput = index;
+                ++pointerState.version;
+            } else if (pointerOutput == index && pointerState.visible) {
+                pointerState.visible = false;
+                ++pointerState.version;
+            }
+        }
+        if (info.PointerShapeBufferSize > 0) {
+            pointerState.shape.resize(info.PointerShapeBufferSize);
+            UINT required = 0;
+            if (SUCCEEDED(s.duplication->GetFramePointerShape(info.PointerShapeBufferSize, pointerState.shape.data(),
+                                                              &required, &pointerState.shapeInfo))) {
+                ++pointerState.shapeVersion;
+                ++pointerState.version;
+            } else {
+                pointerState.shape.clear();
+            }
+        }
+    }
+
+    ID3D11Device* device = nullptr;
+    ID3D11DeviceContext* context = nullptr;
+    std::vector<DisplayOutput> outputs;
+    PointerState pointerState;
+    size_t pointerOutput = 0;
+    std::vector<Source> sources;
+    ComPtr<ID3D11Texture2D> composite;
+    int compositeWidth = 0;
+    int compositeHeight = 0;
+};
+
+// --- Pointer drawing ---
+// GDI icon from the DXGI shape for drawing on a GPU surface. GDI icons
+// compute dst = (dst AND mask) XOR color, which is exactly what monochrome
+// and masked-color pointers mean; colour pointers get a mask for their
+// transparent pixels so they hold up even where alpha is ignored.
+HICON createPointerIcon(const PointerState& pointer) {
+    const DXGI_OUTDUPL_POINTER_SHAPE_INFO& info = pointer.shapeInfo;
+    if (pointer.shape.empty() || info.Width == 0 || info.Height == 0) return nullptr;
+    const int w = (int)info.Width;
+    const int h = (int)info.Height;     // monochrome: AND mask rows, then XOR mask rows
+    const int maskPitch = ((w + 15) / 16) * 2; // GDI rows are WORD aligned
+    ICONINFO iconInfo = {};
+    iconInfo.fIcon = FALSE;
+    iconInfo.xHotspot = info.HotSpot.x;
+    iconInfo.yHotspot = info.HotSpot.y;
+    if (info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME) {
+        std::vector<BYTE> mask((size_t)maskPitch * h, 0);
+        for (int y = 0; y < h; ++y) {
+            memcpy(&mask[(size_t)y * maskPitch], &pointer.shape[(size_t)y * info.Pitch], std::min<int>(maskPitch, info.Pitch));
+        }
+        iconInfo.hbmMask = CreateBitmap(w, h, 1, 1, mask.data());
+    } else {
+        std::vector<BYTE> mask((size_t)maskPitch * h, 0);
+        std::vector<uint32_t> color((size_t)w * h);
+        for (int y = 0; y < h; ++y) {
+            const uint32_t* row = (const uint32_t*)&pointer.shape[(size_t)y * info.Pitch];
+            for (int x = 0; x < w; ++x) {
+                uint32_t px = row[x];
+                bool masked = info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR ? (px >> 24) != 0 : (px >> 24) == 0;
+                if (masked) mask[(size_t)y * maskPitch + x / 8] |= 0x80 >> (x % 8);
+                if (info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR) px &= 0x00ffffff;
+                else if (masked) px = 0;
+                color[(size_t)y * w + x] = px;
+            }
+        }
+        iconInfo.hbmMask = CreateBitmap(w, h, 1, 1, mask.data());
+        iconInfo.hbmColor = CreateBitmap(w, h, 1, 32, color.data());
+    }
+    HICON icon = CreateIconIndirect(&iconInfo);
+    DeleteObject(iconInfo.hbmMask);
+    if (iconInfo.hbmColor) DeleteObject(iconInfo.hbmColor);
+    return icon;
+}
+
+// Blends the pointer into a YUV420P or NV12 frame, touching only the
+// pointer's rect (a few thousand pixels at most). XOR pixels invert luma,
+// which is what they do to text and most backgrounds. The BT.601 limited
+// range matrix matches sws_scale and the GPU converter.
+class CursorBlender {
+public:
+    // Frame area blend() draws on, widened to even coordinates for 4:2:0
+    // chroma; false when it draws nothing
+    bool bounds(const AVFrame* frame, const PointerState& pointer, double scaleX, double scaleY,
+                int& x, int& y, int& bw, int& bh) {
+        if (!pointer.visible || pointer.shape.empty()) return false;
+        if (pointer.shapeVersion != version) rebuild(pointer);
+        const int x0 = (int)(pointer.x * scaleX);
+        const int y0 = (int)(pointer.y * scaleY);
+        x = std::max(0, x0) & ~1;
+        y = std::max(0, y0) & ~1;
+        bw = std::min(frame->width, (x0 + w + 1) & ~1) - x;
+        bh = std::min(frame->height, (y0 + h + 1) & ~1) - y;
+        return bw > 0 && bh > 0;
+    }
+
+    // scaleX/scaleY map capture coordinates to frame coordinates; the
+    // shape itself is not resized
+    void blend(AVFrame* frame, const PointerState& pointer, double scaleX, double scaleY) {
+        if (!pointer.visible || pointer.shape.empty()) return;
+        if (pointer.shapeVersion != version) rebuild(pointer);
+
+        const int x0 = (int)(pointer.x * scaleX);
+        const int y0 = (int)(pointer.y * scaleY);
+        const int x1 = std::min(frame->width, x0 + w);
+        const int y1 = std::min(frame->height, y0 + h);
+        for (int fy = std::max(0, y0); fy < y1; ++fy) {
+            uint8_t* luma = frame->data[0] + (size_t)fy * frame->linesize[0];
+            const Pixel* row = &pixels[(size_t)(fy - y0) * w];
+            for (int fx = std::max(0, x0); fx < x1; ++fx) {
+                const Pixel& px = row[fx - x0];
+                if (px.invert) luma[fx] = (uint8_t)std::min(235, std::max(16, 251 - luma[fx]));
+                else if (px.alpha) luma[fx] = (uint8_t)(luma[fx] + (px.y - luma[fx]) * px.alpha / 255);
+            }
+        }
+
+        // One chroma sample per 2x2 block, weighted by how much of it the pointer covers
+        const bool nv12 = frame->format == AV_PIX_FMT_NV12;
+        for (int cy = std::max(0, y0) / 2; cy <= (y1 - 1) / 2; ++cy) {
+            uint8_t* u = frame->data[1] + (size_t)cy * frame->linesize[1];
+            uint8_t* v = nv12 ? u + 1 : frame->data[2] + (size_t)cy * frame->linesize[2];
+            for (int cx = std::max(0, x0) / 2; cx <= (x1 - 1) / 2; ++cx) {
+                int alphaSum = 0, uSum = 0, vSum = 0;
+                for (int sy = cy * 2; sy < cy * 2 + 2; ++sy) {
+                    for (int sx = cx * 2; sx < cx * 2 + 2; ++sx) {
+                        if (sx < x0 || sy < y0 || sx >= x0 + w || sy >= y0 + h) continue;
+                        const Pixel& px = pixels[(size_t)(sy - y0) * w + (sx - x0)];
+                        if (px.invert || !px.alpha) continue;
+                        alphaSum += px.alpha;
+                        uSum += px.u * px.alpha;
+                        vSum += px.v * px.alpha;
+                    }
+                }
+                if (!alphaSum) continue;
+                size_t i = nv12 ? (size_t)cx * 2 : (size_t)cx;
+                u[i] = (uint8_t)(u[i] + (uSum / alphaSum - u[i]) * alphaSum / 1020);
+                v[i] = (uint8_t)(v[i] + (vSum / alphaSum - v[i]) * alphaSum / 1020);
+            }
+        }
+    }
+
+private:
+    struct Pixel {
+        uint8_t y = 16, u = 128, v = 128;
+        uint8_t alpha = 0; // 0 = transparent
+        bool invert = false;
+    };
+
+    static Pixel fromRgb(int r, int g, int b, int alpha) {
+        Pixel px;
+        px.y = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        px.u = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        px.v = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        px.alpha = (uint8_t)alpha;
+        return px;
+    }
+
+    void rebuild(const PointerState& pointer) {
+        const DXGI_OUTDUPL_POINTER_SHAPE_INFO& info = pointer.shapeInfo;
+        const bool mono = info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME;
+        w = (int)info.Width;
+        h = mono ? (int)info.Height / 2 : (int)info.Height;
+        pixels.assign((size_t)w * h, Pixel());
+        for (int y = 0; y < h; ++y) {
+            for (int x = 0; x < w; ++x) {
+                Pixel& px = pixels[(size_t)y * w + x];
+                if (mono) {
+                    auto bit = [&](int row) { return (pointer.shape[(size_t)row * info.Pitch + x / 8] >> (7 - x % 8)) & 1; };
+                    int andBit = bit(y), xorBit = bit(y + h);
+                    if (!andBit) px = fromRgb(xorBit * 255, xorBit * 255, xorBit * 255, 255);
+                    else px.invert = xorBit != 0;
+                    continue;
+                }
+                const BYTE* bgra = &pointer.shape[(size_t)y * info.Pitch + x * 4];
+                if (info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR && bgra[3]) {
+                    px.invert = bgra[0] || bgra[1] || bgra[2]; // XOR with black changes nothing
+                } else {
+                    int alpha = info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR ? 255 : bgra[3];
+                    px = fromRgb(bgra[2], bgra[1], bgra[0], alpha);
+                }
+            }
+        }
+        version = pointer.shapeVersion;
+    }
+
+    std::vector<Pixel> pixels;
+    int w = 0, h = 0;
+    uint64_t version = 0;
+};
+
+// The pixels of a 4:2:0 frame (planar or NV12) under the pointer, so a
+// frame with the pointer drawn on it can give back the clean scene
+class PointerPatch {
+public:
+    void save(const AVFrame* frame, int px, int py, int pw, int ph) {
+        x = px;
+        y = py;
+        w = pw;
+        h = ph;
+        pixels.clear();
+        forEachRow(frame, [&](const uint8_t* row, int bytes) { pixels.insert(pixels.end(), row, row + bytes); });
+    }
+
+    void clear() { w = h = 0; }
+
+    void restore(AVFrame* frame) const {
+        const uint8_t* from = pixels.data();
+        forEachRow(frame, [&](uint8_t* row, int bytes) {
+            std::memcpy(row, from, bytes);
+            from += bytes;
+        });
+    }
+
+private:
+    template <typename Frame, typename Fn>
+    void forEachRow(Frame* frame, Fn fn) const {
+        if (!w || !h) return;
+        const AVPixelFormat format = (AVPixelFormat)frame->format;
+        const int planes = av_pix_fmt_count_planes(format);
+        for (int p = 0; p < planes; ++p) {
+            const int shift = p ? 1 : 0;
+            const int offset = av_image_get_linesize(format, x, p);
+            const int bytes = av_image_get_linesize(format, w, p);
+            for (int row = y >> shift; row < (y + h) >> shift; ++row) {
+                fn(frame->data[p] + (size_t)row * frame->linesize[p] + offset, bytes);
+            }
+        }
+    }
+
+    std::vector<uint8_t> pixels;
+    int x = 0, y = 0, w = 0, h = 0;
+};
+
+// --- Duplicate detection ---
+// Position-sensitive (Fletcher-style) 64-bit hash of a mapped surface at
+// full width: two SSE2 adds per 16 bytes, still far below the cost of a
+// conversion. rowStep 1 reads every row; a larger step (--sampled-hash)
+// is cheaper but misses updates that fit between the sampled rows.
+uint64_t hashSurface(const uint8_t* data, int pitch, int rowBytes, int rows, int rowStep) {
+    __m128i sum = _mm_set_epi64x(0x9e3779b97f4a7c15ull, 0x2545f4914f6cdd1dull);
+    __m128i weighted = _mm_setzero_si128();
+    uint64_t tail = 0;
+    const int vectorBytes = rowBytes & ~15;
+    for (int y = 0; y < rows; y += rowStep) {
+        const uint8_t* row = data + (size_t)y * pitch;
+        for (int x = 0; x < vectorBytes; x += 16) {
+            sum = _mm_add_epi64(sum, _mm_loadu_si128((const __m128i*)(row + x)));
+            weighted = _mm_add_epi64(weighted, sum);
+        }
+        for (int x = vectorBytes; x < rowBytes; ++x) tail = tail * 31 + row[x];
+    }
+    uint64_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    _mm_storeu_si128((__m128i*)(lanes + 2), weighted);
+    uint64_t h = tail;
+    for (uint64_t lane : lanes) h = (h ^ lane) * 0x100000001b3ull;
+    return h;
+}
+
+// --- Staging ring ---
+// N staging textures shared by the capture thread, which copies the desktop
+// into a free slot, and the convert stage, which maps it once the GPU copy
+// is done and hands it back. Free slots travel back through their own SPSC
+// ring, like pool frames, so up to N copies are in flight.
+class StagingRing {
+public:
+    // Only while no slot is handed out; init() again replaces the textures
+    bool init(ID3D11Device* device, const D3D11_TEXTURE2D_DESC& desc, int count, WaitStrategy wait) {
+        slots.resize(count);
+        freeSlots.reset(new SpscRing<int>(count, wait));
+        spare.clear();
+        for (int i = 0; i < count; ++i) {
+            if (FAILED(device->CreateTexture2D(&desc, nullptr, &slots[i]))) return false;
+            freeSlots->push(i);
+        }
+        return true;
+    }
+
+    int size() const { return (int)slots.size(); }
+    ID3D11Texture2D* slot(int index) { return slots[index].Get(); }
+
+    // Capture thread; -1 if the convert stage returned none within timeoutMs
+    int acquire(int timeoutMs) {
+        int index = -1;
+        if (!spare.empty()) {
+            index = spare.back();
+            spare.pop_back();
+            return index;
+        }
+        return freeSlots->pop(index, timeoutMs) ? index : -1;
+    }
+
+    // Capture thread: a slot from acquire() that was never filled
+    void putBack(int index) { spare.push_back(index); }
+
+    // Convert stage, once the slot is unmapped
+    void release(int index) { freeSlots->push(index); }
+
+private:
+    std::vector<ComPtr<ID3D11Texture2D>> slots;
+    std::unique_ptr<SpscRing<int>> freeSlots;
+    std::vector<int> spare;
+};
+
+// Capture thread -> convert stage
+struct StageItem {
+    enum Kind { STAGED, SCENE, UNCHANGED, HOLD };
+    Kind kind;
+    int slot;    // STAGED: the staging slot holding the frame
+    int64_t pts;
+};
+
+// --- Dirty-rect tracking ---
+// Incremental mode: only regions DXGI reports as changed are copied into the
+// staging ring and re-converted into a persistent YUV frame. Each slot holds
+// an older frame, so every slot remembers what changed since it was written.
+class DirtyTracker {
+public:
+    void init(int slotCount, int width, int height) {
+        this->width = width;
+        this->height = height;
+        invalidate(slotCount);
+    }
+
+    // Forget everything: every slot gets a full copy and a full conversion
+    void invalidate(int slotCount) {
+        stale.assign(slotCount, std::vector<RECT>{ fullRect() });
+        changed.assign(slotCount, std::vector<RECT>{ fullRect() });
+    }
+
+    // Records this frame's changes and returns the regions the slot needs
+    // from the desktop texture to become an exact copy of it
+    const std::vector<RECT>& prepareSlot(int slot, const std::vector<RECT>& frameRects) {
+        for (auto& list : stale) append(list, frameRects);
+        copyRects.swap(stale[slot]);
+        stale[slot].clear();
+        changed[slot] = frameRects;
+        return copyRects;
+    }
+
+    // Regions that differ between the frame in this slot and the one before
+    const std::vector<RECT>& changedRects(int slot) const { return changed[slot]; }
+
+    RECT fullRect() const { return RECT{ 0, 0, width, height }; }
+
+private:
+    void append(std::vector<RECT>& list, const std::vector<RECT>& rects) {
+        if (list.size() == 1 && isFull(list[0])) return;
+        list.insert(list.end(), rects.begin(), rects.end());
+        if (list.size() > 64) list.assign(1, fullRect()); // not worth tracking
+    }
+
+    bool isFull(const RECT& r) const {
+        return r.left <= 0 && r.top <= 0 && r.right >= width && r.bottom >= height;
+    }
+
+    int width = 0;
+    int height = 0;
+    std::vector<std::vector<RECT>> stale;
+    std::vector<std::vector<RECT>> changed;
+    std::vector<RECT> copyRects;
+};
+
+// Move and dirty rects of the acquired frame, clipped and aligned to even
+// coordinates for 4:2:0 chroma. Returns false if the metadata is unavailable.
+bool getChangedRects(IDXGIOutputDuplication* duplication, const DXGI_OUTDUPL_FRAME_INFO& frameInfo,
+                     std::vector<BYTE>& buffer, std::vector<RECT>& rects, int width, int height) {
+    rects.clear();
+    if (frameInfo.TotalMetadataBufferSize == 0) return false;
+    if (buffer.size() < frameInfo.TotalMetadataBufferSize) buffer.resize(frameInfo.TotalMetadataBufferSize);
+
+    // Move destinations are changed content too; the staging copy picks up
+    // the moved pixels from the desktop, so the source side needs no work
+    UINT used = 0;
+    if (FAILED(duplication->GetFrameMoveRects((UINT)buffer.size(), (DXGI_OUTDUPL_MOVE_RECT*)buffer.data(), &used))) {
+        return false;
+    }
+    const DXGI_OUTDUPL_MOVE_RECT* moves = (const DXGI_OUTDUPL_MOVE_RECT*)buffer.data();
+    for (UINT i = 0; i < used / sizeof(DXGI_OUTDUPL_MOVE_RECT); ++i) rects.push_back(moves[i].DestinationRect);
+
+    if (FAILED(duplication->GetFrameDirtyRects((UINT)buffer.size(), (RECT*)buffer.data(), &used))) {
+        return false;
+    }
+    const RECT* dirty = (const RECT*)buffer.data();
+    for (UINT i = 0; i < used / sizeof(RECT); ++i) rects.push_back(dirty[i]);
+
+    for (auto& r : rects) {
+        r.left = std::max<LONG>(0, r.left & ~1);
+        r.top = std::max<LONG>(0, r.top & ~1);
+        r.right = std::min<LONG>(width, (r.right + 1) & ~1);
+        r.bottom = std::min<LONG>(height, (r.bottom + 1) & ~1);
+    }
+    rects.erase(std::remove_if(rects.begin(), rects.end(),
+                               [](const RECT& r) { return r.right <= r.left || r.bottom <= r.top; }),
+                rects.end());
+    return true;
+}
+
+// BGRA -> YUV420P over a grid of 64x16 tiles. Runs of dirty tiles in a tile
+// row go through one sws_scale call each, with a context cached per run size.
+class TileConverter {
+public:
+    static const int TILE_W = 64;
+    static const int TILE_H = 16;
+
+    TileConverter(int width, int height, int swsFlags) : width(width), height(height), swsFlags(swsFlags) {
+        cols = (width + TILE_W - 1) / TILE_W;
+        rows = (height + TILE_H - 1) / TILE_H;
+        dirtyTiles.resize(cols * rows);
+    }
+
+    ~TileConverter() {
+        for (auto& entry : contexts) sws_freeContext(entry.second);
+    }
+
+    bool convert(const uint8_t* src, int srcPitch, AVFrame* dst, const std::vector<RECT>& rects) {
+        std::fill(dirtyTiles.begin(), dirtyTiles.end(), 0);
+        int dirtyCount = 0;
+        for (const auto& r : rects) {
+            for (int ty = r.top / TILE_H; ty <= (r.bottom - 1) / TILE_H; ++ty) {
+                for (int tx = r.left / TILE_W; tx <= (r.right - 1) / TILE_W; ++tx) {
+                    uint8_t& tile = dirtyTiles[ty * cols + tx];
+                    dirtyCount += !tile;
+                    tile = 1;
+                }
+            }
+        }
+
+        // Mostly dirty: one full-frame call is cheaper than many small ones
+        if (dirtyCount * 2 > cols * rows) return convertRegion(src, srcPitch, dst, 0, 0, width, height);
+
+        for (int ty = 0; ty < rows; ++ty) {
+            for (int tx = 0; tx < cols; ++tx) {
+                if (!dirtyTiles[ty * cols + tx]) continue;
+                int runEnd = tx;
+                while (runEnd + 1 < cols && dirtyTiles[ty * cols + runEnd + 1]) ++runEnd;
+                int x = tx * TILE_W;
+                int y = ty * TILE_H;
+                int w = std::min((runEnd + 1) * TILE_W, width) - x;
+                int h = std::min(y + TILE_H, height) - y;
+                if (!convertRegion(src, srcPitch, dst, x, y, w, h)) return false;
+                tx = runEnd;
+            }
+        }
+        return true;
+    }
+
+private:
+    bool convertRegion(const uint8_t* src, int srcPitch, AVFrame* dst, int x, int y, int w, int h) {
+        SwsContext*& ctx = contexts[std::make_pair(w, h)];
+        if (!ctx) {
+            ctx = sws_getContext(w, h, AV_PIX_FMT_BGRA, w, h, AV_PIX_FMT_YUV420P,
+                                 swsFlags, nullptr, nullptr, nullptr);
+            if (!ctx) return false;
+        }
+        const uint8_t* srcData[1] = { src + (size_t)y * srcPitch + x * 4 };
+        int srcLinesize[1] = { srcPitch };
+        uint8_t* dstData[3] = {
+            dst->data[0] + (size_t)y * dst->linesize[0] + x,
+            dst->data[1] + (size_t)(y / 2) * dst->linesize[1] + x / 2,
+            dst->data[2] + (size_t)(y / 2) * dst->linesize[2] + x / 2,
+        };
+        return sws_scale(ctx, srcData, srcLinesize, 0, h, dstData, dst->linesize) > 0;
+    }
+
+    int width, height, swsFlags;
+    int cols, rows;
+    std::vector<uint8_t> dirtyTiles;
+    std::map<std::pair<int, int>, SwsContext*> contexts;
+};
+
+// --- Sliced conversion ---
+// The unscaled BGRA -> YUV420P conversion split into horizontal bands, each
+// converted by a persistent worker with its own SwsContext. start() returns
+// at once and finish() waits for every band. Scaling is left to a single SwsContext, as
+// bands would each clamp the filter at their edges.
+class SliceConverter {
+public:
+    ~SliceConverter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : workers) t.join();
+        for (Band& band : bands) sws_freeContext(band.ctx);
+    }
+
+    bool init(int width, int height, int threads, int swsFlags, DWORD_PTR affinity) {
+        int bandHeight = ((height + threads - 1) / threads + 1) & ~1; // even for 4:2:0 chroma
+        for (int y = 0; y < height; y += bandHeight) {
+            Band band;
+            band.y = y;
+            band.height = std::min(bandHeight, height - y);
+            band.ctx = sws_getContext(width, band.height, AV_PIX_FMT_BGRA, width, band.height, AV_PIX_FMT_YUV420P,
+                                      swsFlags, nullptr, nullptr, nullptr);
+            if (!band.ctx) return false;
+            bands.push_back(band);
+        }
+        for (size_t i = 0; i < bands.size(); ++i) workers.emplace_back(&SliceConverter::run, this, i, affinity);
+        return true;
+    }
+
+    int slices() const { return (int)bands.size(); }
+
+    // src stays mapped and dst untouched until finish()
+    void start(const uint8_t* src, int pitch, AVFrame* dst) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobSrc = src;
+            jobPitch = pitch;
+            jobDst = dst;
+            remaining = (int)bands.size();
+            failed = false;
+            ++generation;
+        }
+        wake.notify_all();
+    }
+
+    // True when every band converted
+    bool finish() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]() { return remaining == 0; });
+        return !failed;
+    }
+
+private:
+    struct Band {
+        int y = 0;
+        int height = 0;
+        SwsContext* ctx = nullptr;
+    };
+
+    void run(size_t index, DWORD_PTR affinity) {
+        ScopedThreadPolicy policy(ThreadRole::Capture, affinity);
+        const Band& band = bands[index];
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return quit || generation != seen; });
+                if (quit) return;
+                seen = generation;
+            }
+            // The job fields do not change until every band has reported back
+            const uint8_t* srcData[1] = { jobSrc + (size_t)band.y * jobPitch };
+            int srcLinesize[1] = { jobPitch };
+            uint8_t* dstData[3] = {
+                jobDst->data[0] + (size_t)band.y * jobDst->linesize[0],
+                jobDst->data[1] + (size_t)(band.y / 2) * jobDst->linesize[1],
+                jobDst->data[2] + (size_t)(band.y / 2) * jobDst->linesize[2],
+            };
+            bool ok = sws_scale(band.ctx, srcData, srcLinesize, 0, band.height, dstData, jobDst->linesize) > 0;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ok) failed = true;
+            if (--remaining == 0) done.notify_one();
+        }
+    }
+
+    std::vector<Band> bands;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint64_t generation = 0;
+    bool quit = false;
+    const uint8_t* jobSrc = nullptr;
+    int jobPitch = 0;
+    AVFrame* jobDst = nullptr;
+    int remaining = 0;
+    bool failed = false;
+};
+
+// --- GPU colour conversion ---
+// BGRA -> NV12 on the GPU with the D3D11 video processor, so readback is
+// 1.5 bytes/pixel instead of 4 and the CPU never runs sws_scale. The same
+// blit also scales, so with a BGRA output it serves as a plain GPU downscaler
+// in front of the sws_scale path.
+class GpuConverter {
+public:
+    ~GpuConverter() {
+        if (pointerIcon) DestroyIcon(pointerIcon);
+    }
+
+    // drawPointer makes the input texture GDI-compatible so convert() can
+    // draw the pointer into it
+    bool init(ID3D11Device* device, ID3D11DeviceContext* context, int inWidth, int inHeight,
+              int outWidth, int outHeight, DXGI_FORMAT outFormat = DXGI_FORMAT_NV12, bool drawPointer = false) {
+        targetViews.clear(); // init() again after a size change starts over
+        if (FAILED(device->QueryInterface(__uuidof(ID3D11VideoDevice), (void**)&videoDevice))) return false;
+        if (FAILED(context->QueryInterface(__uuidof(ID3D11VideoContext), (void**)&videoContext))) return false;
+        this->context = context;
+
+        D3D11_VIDEO_PROCESSOR_CONTENT_DESC contentDesc = {};
+        contentDesc.InputFrameFormat = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE;
+        contentDesc.InputWidth = inWidth;
+        contentDesc.InputHeight = inHeight;
+        contentDesc.OutputWidth = outWidth;
+        contentDesc.OutputHeight = outHeight;
+        contentDesc.Usage = D3D11_VIDEO_USAGE_OPTIMAL_SPEED;
+        if (FAILED(videoDevice->CreateVideoProcessorEnumerator(&contentDesc, &enumerator))) return false;
+
+        UINT support = 0;
+        if (FAILED(enumerator->CheckVideoProcessorFormat(DXGI_FORMAT_B8G8R8A8_UNORM, &support)) ||
+            !(support & D3D11_VIDEO_PROCESSOR_FORMAT_SUPPORT_INPUT)) return false;
+        if (FAILED(enumerator->CheckVideoProcessorFormat(outFormat, &support)) ||
+            !(support & D3D11_VIDEO_PROCESSOR_FORMAT_SUPPORT_OUTPUT)) return false;
+        if (FAILED(videoDevice->CreateVideoProcessor(enumerator.Get(), 0, &processor))) return false;
+
+        // The duplication may hand back a different texture every frame and
+        // views are bound to one resource, so the desktop is copied into a
+        // texture of our own first (a GPU-local copy, nearly free)
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = inWidth;
+        desc.Height = inHeight;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+        desc.MiscFlags = drawPointer ? D3D11_RESOURCE_MISC_GDI_COMPATIBLE : 0;
+        gdiInput = drawPointer && SUCCEEDED(device->CreateTexture2D(&desc, nullptr, &inputTexture));
+        if (!gdiInput) {
+            desc.MiscFlags = 0; // no pointer rather than no GPU conversion
+            if (FAILED(device->CreateTexture2D(&desc, nullptr, &inputTexture))) return false;
+        }
+
+        desc.Width = outWidth;
+        desc.MiscFlags = 0;
+        desc.Height = outHeight;
+        desc.Format = outFormat;
+        desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+        if (FAILED(device->CreateTexture2D(&desc, nullptr, &outputTexture))) return false;
+
+        D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC inDesc = {};
+        inDesc.ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D;
+        if (FAILED(videoDevice->CreateVideoProcessorInputView(inputTexture.Get(), enumerator.Get(),
+                                                              &inDesc, &inputView))) return false;
+
+        D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC outDesc = {};
+        outDesc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+        if (FAILED(videoDevice->CreateVideoProcessorOutputView(outputTexture.Get(), enumerator.Get(),
+                                                               &outDesc, &outputView))) return false;
+
+        // Full-range RGB in, BT.601 limited-range YUV out: the same matrix
+        // sws_scale uses by default, so both paths look identical. A BGRA
+        // output stays full-range RGB.
+        D3D11_VIDEO_PROCESSOR_COLOR_SPACE inSpace = {};
+        inSpace.RGB_Range = 0;
+        D3D11_VIDEO_PROCESSOR_COLOR_SPACE outSpace = {};
+        outSpace.RGB_Range = 0;
+        outSpace.YCbCr_Matrix = 0;
+        outSpace.Nominal_Range = 1; // 16-235
+        videoContext->VideoProcessorSetStreamColorSpace(processor.Get(), 0, &inSpace);
+        videoContext->VideoProcessorSetOutputColorSpace(processor.Get(), &outSpace);
+        videoContext->VideoProcessorSetStreamFrameFormat(processor.Get(), 0, D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE);
+
+        // Whole desktop onto the whole output; the blit does the scaling
+        RECT inRect = { 0, 0, inWidth, inHeight };
+        RECT outRect = { 0, 0, outWidth, outHeight };
+        videoContext->VideoProcessorSetStreamSourceRect(processor.Get(), 0, TRUE, &inRect);
+        videoContext->VideoProcessorSetStreamDestRect(processor.Get(), 0, TRUE, &outRect);
+        videoContext->VideoProcessorSetOutputTargetRect(processor.Get(), TRUE, &outRect);
+        videoContext->VideoProcessorSetStreamAutoProcessingMode(processor.Get(), 0, FALSE);
+        return true;
+    }
+
+    // Converts (and scales) the desktop texture into output(), or into one
+    // slice of an NV12 texture array such as FFmpeg's D3D11 frame pool.
+    // With a pointer it is drawn onto the desktop first, so it scales too.
+    bool convert(ID3D11Texture2D* desktop, ID3D11Texture2D* target = nullptr, UINT targetSlice = 0,
+                 const PointerState* pointer = nullptr) {
+        ID3D11VideoProcessorOutputView* view = target ? targetView(target, targetSlice) : outputView.Get();
+        if (!view) return false;
+
+        context->CopyResource(inputTexture.Get(), desktop);
+        if (pointer && pointer->visible && gdiInput) drawPointer(*pointer);
+
+        D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+        stream.Enable = TRUE;
+        stream.pInputSurface = inputView.Get();
+        return SUCCEEDED(videoContext->VideoProcessorBlt(processor.Get(), view, 0, 1, &stream));
+    }
+
+    ID3D11Texture2D* output() { return outputTexture.Get(); }
+
+private:
+    void drawPointer(const PointerState& pointer) {
+        if (pointer.shapeVersion != pointerIconVersion) {
+            if (pointerIcon) DestroyIcon(pointerIcon);
+            pointerIcon = createPointerIcon(pointer);
+            pointerIconVersion = pointer.shapeVersion;
+        }
+        ComPtr<IDXGISurface1> surface;
+        HDC dc = nullptr;
+        if (!pointerIcon || FAILED(inputTexture.As(&surface)) || FAILED(surface->GetDC(FALSE, &dc))) return;
+        DrawIconEx(dc, pointer.x, pointer.y, pointerIcon, 0, 0, 0, nullptr, DI_NORMAL);
+        surface->ReleaseDC(nullptr);
+    }
+
+    // Output views for external targets, created once per texture slice
+    ID3D11VideoProcessorOutputView* targetView(ID3D11Texture2D* target, UINT slice) {
+        auto key = std::make_pair(target, slice);
+        auto it = targetViews.find(key);
+        if (it != targetViews.end()) return it->second.Get();
+
+        D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC desc = {};
+        desc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2DARRAY;
+        desc.Texture2DArray.FirstArraySlice = slice;
+        desc.Texture2DArray.ArraySize = 1;
+        ComPtr<ID3D11VideoProcessorOutputView> view;
+        if (FAILED(videoDevice->CreateVideoProcessorOutputView(target, enumerator.Get(), &desc, &view))) return nullptr;
+        targetViews[key] = view;
+        return view.Get();
+    }
+
+    ID3D11DeviceContext* context = nullptr;
+    ComPtr<ID3D11VideoDevice> videoDevice;
+    ComPtr<ID3D11VideoContext> videoContext;
+    ComPtr<ID3D11VideoProcessorEnumerator> enumerator;
+    ComPtr<ID3D11VideoProcessor> processor;
+    ComPtr<ID3D11Texture2D> inputTexture;
+    ComPtr<ID3D11Texture2D> outputTexture;
+    ComPtr<ID3D11VideoProcessorInputView> inputView;
+    ComPtr<ID3D11VideoProcessorOutputView> outputView;
+    std::map<std::pair<ID3D11Texture2D*, UINT>, ComPtr<ID3D11VideoProcessorOutputView>> targetViews;
+    bool gdiInput = false;
+    HICON pointerIcon = nullptr;
+    uint64_t pointerIconVersion = 0;
+};
+
+// Copies a mapped NV12 staging texture into an NV12 AVFrame
+void copyMappedNV12(const D3D11_MAPPED_SUBRESOURCE& mapped, AVFrame* frame, int width, int height) {
+    const uint8_t* luma = (const uint8_t*)mapped.pData;
+    const uint8_t* chroma = luma + (size_t)mapped.RowPitch * height; // UV plane follows Y
+    av_image_copy_plane(frame->data[0], frame->linesize[0], luma, mapped.RowPitch, width, height);
+    av_image_copy_plane(frame->data[1], frame->linesize[1], chroma, mapped.RowPitch, width, height / 2);
+}
+
+// Serialises the immediate context for callers on more than one thread
+void enableMultithreadProtection(ID3D11Device* device) {
+    ComPtr<ID3D10Multithread> multithread;
+    if (SUCCEEDED(device->QueryInterface(__uuidof(ID3D10Multithread), (void**)&multithread))) {
+        multithread->SetMultithreadProtected(TRUE);
+    }
+}
+
+// --- Hardware encode ---
+// Wraps the capture device in an FFmpeg D3D11VA device plus a pool of NV12
+// render-target textures the video processor draws into, so encoders that
+// take AV_PIX_FMT_D3D11 frames read the desktop without any CPU readback
+bool createHwFrames(ID3D11Device* device, int width, int height, int poolSize,
+                    AVBufferRef** deviceRef, AVBufferRef** framesRef) {
+    enableMultithreadProtection(device); // the encoder thread shares the immediate context
+
+    *deviceRef = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_D3D11VA);
+    if (!*deviceRef) return false;
+    AVHWDeviceContext* deviceCtx = (AVHWDeviceContext*)(*deviceRef)->data;
+    AVD3D11VADeviceContext* d3d11Ctx = (AVD3D11VADeviceContext*)deviceCtx->hwctx;
+    d3d11Ctx->device = device;
+    device->AddRef(); // released by FFmpeg with the device context
+    if (av_hwdevice_ctx_init(*deviceRef) < 0) {
+        av_buffer_unref(deviceRef);
+        return false;
+    }
+
+    *framesRef = av_hwframe_ctx_alloc(*deviceRef);
+    if (!*framesRef) {
+        av_buffer_unref(deviceRef);
+        return false;
+    }
+    AVHWFramesContext* framesCtx = (AVHWFramesContext*)(*framesRef)->data;
+    framesCtx->format = AV_PIX_FMT_D3D11;
+    framesCtx->sw_format = AV_PIX_FMT_NV12;
+    framesCtx->width = width;
+    framesCtx->height = height;
+    framesCtx->initial_pool_size = poolSize;
+    AVD3D11VAFramesContext* d3d11Frames = (AVD3D11VAFramesContext*)framesCtx->hwctx;
+    d3d11Frames->BindFlags = D3D11_BIND_RENDER_TARGET;
+    if (av_hwframe_ctx_init(*framesRef) < 0) {
+        av_buffer_unref(framesRef);
+        av_buffer_unref(deviceRef);
+        return false;
+    }
+    return true;
+}
+
+AVCodecContext* openHwEncoder(const char* name, AVBufferRef* framesRef, int width, int height, int fps,
+                              AVRational timeBase, bool globalHeader, int64_t bitRate, int gopSize) {
+    const AVCodec* codec = avcodec_find_encoder_by_name(name);
+    if (!codec) return nullptr;
+
+    AVCodecContext* ctx = avcodec_alloc_context3(codec);
+    ctx->width = width;
+    ctx->height = height;
+    ctx->pix_fmt = AV_PIX_FMT_D3D11;
+    ctx->hw_frames_ctx = av_buffer_ref(framesRef);
+    ctx->bit_rate = bitRate;
+    ctx->rc_buffer_size = ctx->bit_rate;
+    ctx->rc_max_rate = ctx->bit_rate;
+    ctx->gop_size = gopSize;
+    ctx->max_b_frames = 0;
+    ctx->time_base = timeBase;
+    ctx->framerate = {fps, 1}; // nominal rate for rate control, even with VFR timestamps
+    if (globalHeader) ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    // Fastest low-latency settings per vendor
+    std::string id = name;
+    if (id == "h264_nvenc") {
+        av_opt_set(ctx->priv_data, "preset", "p1", 0);
+        av_opt_set(ctx->priv_data, "tune", "ll", 0);
+    } else if (id == "h264_amf") {
+        av_opt_set(ctx->priv_data, "usage", "lowlatency", 0);
+        av_opt_set(ctx->priv_data, "quality", "speed", 0);
+    } else if (id == "h264_qsv") {
+        av_opt_set(ctx->priv_data, "preset", "veryfast", 0);
+    }
+    av_opt_set(ctx->priv_data, "profile", "main", 0);
+
+    if (avcodec_open2(ctx, codec, nullptr) < 0) {
+        avcodec_free_context(&ctx);
+        return nullptr;
+    }
+    return ctx;
+}
+
+// --- Asynchronous file output ---
+// A custom AVIOContext for the muxer: avio writes are copied into large
+// page-aligned blocks, and full blocks go to a writer thread that issues
+// overlapped WriteFile calls, so a disk stall holds up the writer thread and
+// not the encoder. Encoding only waits when every block is queued.
+//
+// With noBuffering, full blocks at sector-aligned offsets bypass the system
+// cache through a second FILE_FLAG_NO_BUFFERING handle. Everything else (the
+// tail, flushes, header patches after a seek) goes through the cached
+// handle, after the queue ahead of it has completed, so writes land in order.
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+#define AVIO_WRITE_BUFFER const uint8_t*
+#else
+#define AVIO_WRITE_BUFFER uint8_t*
+#endif
+
+class AsyncFileWriter {
+public:
+    struct Options {
+        size_t blockBytes = 4 << 20; // multiple of kSector
+        int blockCount = 4;          // blocks in flight or being filled
+        bool noBuffering = false;
+        int64_t preallocBytes = 0;   // space to reserve up front, 0 = none
+    };
+
+    ~AsyncFileWriter() { close(); }
+
+    bool open(const std::string& fileName, const Options& options) {
+        this->options = options;
+        for (int i = 0; i < options.blockCount; ++i) {
+            uint8_t* data = (uint8_t*)VirtualAlloc(nullptr, options.blockBytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+            if (!data) return false;
+            blocks.push_back(data);
+            freeBlocks.push_back(data);
+        }
+        cachedFile = CreateFileA(fileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                 CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, nullptr);
+        if (cachedFile == INVALID_HANDLE_VALUE) return false;
+        if (options.noBuffering) {
+            directFile = CreateFileA(fileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                     OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, nullptr);
+            if (directFile == INVALID_HANDLE_VALUE) std::cerr << "FILE_FLAG_NO_BUFFERING unavailable, using the cache\n";
+        }
+        if (options.preallocBytes > 0) {
+            // Reserves clusters without moving end-of-file; close() trims it
+            FILE_ALLOCATION_INFO alloc = {};
+            alloc.AllocationSize.QuadPart = options.preallocBytes;
+            SetFileInformationByHandle(cachedFile, FileAllocationInfo, &alloc, sizeof(alloc));
+        }
+
+        for (Slot& slot : inFlight) slot.overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        current = takeBlock();
+
+        const int avioBufferSize = 64 * 1024;
+        ioCtx = avio_alloc_context((unsigned char*)av_malloc(avioBufferSize), avioBufferSize, 1, this,
+                                   nullptr, &AsyncFileWriter::writePacket, &AsyncFileWriter::seek);
+        ioCtx->seekable = AVIO_SEEKABLE_NORMAL;
+        worker = std::thread(&AsyncFileWriter::writerLoop, this);
+        return true;
+    }
+
+    AVIOContext* avio() const { return ioCtx; }
+
+    // Pushes what was written since the last flush to the OS without
+    // giving up the current block
+    void flush() {
+        if (!ioCtx) return;
+        avio_flush(ioCtx);
+        if (currentLength > currentSubmitted) {
+            submit({ current + currentSubmitted, currentLength - currentSubmitted, currentOffset + (int64_t)currentSubmitted,
+                     current, false });
+            currentSubmitted = currentLength;
+        }
+    }
+
+    // Writes the tail, waits for the queue and trims the file to its size.
+    // Also releases whatever a failed open() left behind.
+    void close() {
+        if (ioCtx) {
+            avio_flush(ioCtx);
+            retireCurrent();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            worker.join();
+
+            LARGE_INTEGER end;
+            end.QuadPart = fileSize;
+            SetFilePointerEx(cachedFile, end, nullptr, FILE_BEGIN);
+            SetEndOfFile(cachedFile); // also releases unused preallocation
+            av_freep(&ioCtx->buffer);
+            avio_context_free(&ioCtx);
+        }
+        if (directFile != INVALID_HANDLE_VALUE) CloseHandle(directFile);
+        if (cachedFile != INVALID_HANDLE_VALUE) CloseHandle(cachedFile);
+        directFile = cachedFile = INVALID_HANDLE_VALUE;
+        for (Slot& slot : inFlight) {
+            if (slot.overlapped.hEvent) CloseHandle(slot.overlapped.hEvent);
+            slot.overlapped.hEvent = nullptr;
+        }
+        for (uint8_t* data : blocks) VirtualFree(data, 0, MEM_RELEASE);
+        blocks.clear();
+        freeBlocks.clear();
+    }
+
+private:
+    static const int64_t kSector = 4096; // covers 512e and 4Kn drives
+    static const int kMaxInFlight = 2;
+
+    struct Job {
+        uint8_t* data;
+        size_t length;
+        int64_t offset;
+        uint8_t* block; // the block data points into
+        bool recycle;   // last write from the block: back to the free list once written
+    };
+
+    struct Slot {
+        OVERLAPPED overlapped = {};
+        bool busy = false;
+        Job storage = {};
+    };
+
+    static int writePacket(void* opaque, AVIO_WRITE_BUFFER buf, int size) {
+        AsyncFileWriter* self = static_cast<AsyncFileWriter*>(opaque);
+        if (self->failed) return AVERROR(EIO);
+        int remaining = size;
+        while (remaining > 0) {
+            size_t n = std::min<size_t>(remaining, self->options.blockBytes - self->currentLength);
+            memcpy(self->current + self->currentLength, buf, n);
+            self->currentLength += n;
+            buf += n;
+            remaining -= (int)n;
+            self->fileSize = std::max(self->fileSize, self->currentOffset + (int64_t)self->currentLength);
+            if (self->currentLength == self->options.blockBytes) {
+                self->retireCurrent();
+                self->currentOffset += self->currentLength;
+                self->current = self->takeBlock();
+                self->currentLength = 0;
+            }
+        }
+        return size;
+    }
+
+    static int64_t seek(void* opaque, int64_t offset, int whence) {
+        AsyncFileWriter* self = static_cast<AsyncFileWriter*>(opaque);
+        whence &= ~AVSEEK_FORCE;
+        if (whence == AVSEEK_SIZE) return self->fileSize;
+        int64_t position = self->currentOffset + (int64_t)self->currentLength;
+        if (whence == SEEK_SET) position = offset;
+        else if (whence == SEEK_CUR) position += offset;
+        else if (whence == SEEK_END) position = self->fileSize + offset;
+        else return AVERROR(EINVAL);
+        if (position == self->currentOffset + (int64_t)self->currentLength) return position;
+
+        // Finish the current block where it is and continue at the new spot
+        if (self->currentLength > 0) {
+            self->retireCurrent();
+            self->current = self->takeBlock();
+            self->currentLength = 0;
+        }
+        self->currentOffset = position;
+        return position;
+    }
+
+    uint8_t* takeBlock() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return !freeBlocks.empty(); });
+        uint8_t* data = freeBlocks.back();
+        freeBlocks.pop_back();
+        return data;
+    }
+
+    // Hands the rest of the current block to the writer and gives it up.
+    // Only the bytes no flush has written yet go out, except that a full
+    // block for the unbuffered handle is written whole, as that needs the
+    // alignment: flushed bytes are then written twice, never more.
+    void retireCurrent() {
+        size_t from = currentSubmitted;
+        if (directFile != INVALID_HANDLE_VALUE && currentLength == options.blockBytes && currentOffset % kSector == 0) {
+            from = 0;
+        }
+        submit({ current + from, currentLength - from, currentOffset + (int64_t)from, current, true });
+        currentSubmitted = 0;
+    }
+
+    void submit(const Job& job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(job);
+        }
+        cv.notify_all();
+    }
+
+    void writerLoop() {
+        ScopedThreadPolicy policy(ThreadRole::Writer);
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cv.wait(lock, [&] { return !jobs.empty() || stopping; });
+            if (jobs.empty()) break;
+            Job job = jobs.front();
+            jobs.pop_front();
+            lock.unlock();
+
+            bool aligned = directFile != INVALID_HANDLE_VALUE && job.offset % kSector == 0 &&
+                           job.length % kSector == 0;
+            if (aligned) {
+                // Keep up to kMaxInFlight unbuffered writes outstanding
+                Slot* slot = freeSlot();
+                slot->storage = job;
+                issue(directFile, *slot);
+                issued.push_back(slot);
+            } else {
+                waitAll(); // ordered after everything queued before it
+                Slot& slot = inFlight[0];
+                slot.storage = job;
+                issue(cachedFile, slot);
+                complete(cachedFile, slot);
+            }
+            lock.lock();
+        }
+        lock.unlock();
+        waitAll();
+    }
+
+    // Writes complete strictly in the order they were issued, so a block's
+    // recycling job (always its last) is only seen once every earlier write
+    // from the same block has finished
+    Slot* freeSlot() {
+        if ((int)issued.size() == kMaxInFlight) {
+            complete(directFile, *issued.front());
+            issued.pop_front();
+        }
+        for (Slot& slot : inFlight) {
+            if (!slot.busy) return &slot;
+        }
+        return nullptr; // not reached: at most kMaxInFlight - 1 slots are busy here
+    }
+
+    void issue(HANDLE file, Slot& slot) {
+        ResetEvent(slot.overlapped.hEvent);
+        slot.overlapped.Offset = (DWORD)(slot.storage.offset & 0xFFFFFFFF);
+        slot.overlapped.OffsetHigh = (DWORD)(slot.storage.offset >> 32);
+        slot.busy = true;
+        if (!WriteFile(file, slot.storage.data, (DWORD)slot.storage.length, nullptr, &slot.overlapped) &&
+            GetLastError() != ERROR_IO_PENDING) {
+            reportFailure();
+        }
+    }
+
+    void complete(HANDLE file, Slot& slot) {
+        if (!slot.busy) return;
+        DWORD written = 0;
+        if (!GetOverlappedResult(file, &slot.overlapped, &written, TRUE) || written != slot.storage.length) {
+            reportFailure();
+        }
+        slot.busy = false;
+        if (slot.storage.recycle) {
+            std::lock_guard<std::mutex> lock(mutex);
+            freeBlocks.push_back(slot.storage.block);
+            cv.notify_all();
+        }
+    }
+
+    void waitAll() {
+        while (!issued.empty()) {
+            complete(directFile, *issued.front());
+            issued.pop_front();
+        }
+    }
+
+    void reportFailure() {
+        if (!failed.exchange(true)) std::cerr << "Output write failed (error " << GetLastError() << ")\n";
+    }
+
+    Options options;
+    HANDLE cachedFile = INVALID_HANDLE_VALUE;
+    HANDLE directFile = INVALID_HANDLE_VALUE;
+    AVIOContext* ioCtx = nullptr;
+
+    // Producer (muxer) side
+    uint8_t* current = nullptr;
+    size_t currentLength = 0;
+    size_t currentSubmitted = 0; // bytes of the current block already handed to the writer
+    int64_t currentOffset = 0;
+    int64_t fileSize = 0;
+
+    // Shared with the writer thread
+    std::vector<uint8_t*> blocks;
+    std::vector<uint8_t*> freeBlocks;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    std::atomic<bool> failed{false};
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    // Writer thread only
+    Slot inFlight[kMaxInFlight];
+    std::deque<Slot*> issued; // unbuffered writes outstanding, oldest first
+    std::thread worker;
+};
+
+// --- Packet sinks ---
+// Where the encoder threads hand their packets: the muxer, or the replay
+// buffer. Called from several threads; implementations lock.
+class PacketSink {
+public:
+    virtual ~PacketSink() {}
+    virtual int write(AVPacket* pkt, int streamIndex, AVRational codecTimeBase) = 0;
+};
+
+// --- Output muxer ---
+// The video and audio encoders run on their own threads and share one
+// output; writes are serialised here and rescaled from the codec's time base
+// to the stream's. For crash safety the output is flushed every flushMs
+// (fragmented MP4 and Matroska stay playable up to the last flush), and it
+// can be split into segments that start on a video keyframe, each rebased to
+// start at zero, without pausing capture. Audio reaches the muxer about a
+// second ahead of the video it goes with (encoder lookahead, frame queue),
+// so when segmenting it is held back until the video has passed its time
+// and then goes into the segment its own timestamp falls in.
+struct MuxerConfig {
+    std::string format;     // "avi", "matroska" or "mp4"
+    std::string baseName;   // file name without extension
+    std::string extension;
+    int flushMs = 1000;     // fragment / cluster length and avio flush interval
+    int segmentSeconds = 0; // 0 = no time-based segmenting
+    int64_t segmentBytes = 0; // 0 = no size-based segmenting
+    bool asyncIo = false;     // AsyncFileWriter instead of avio_open
+    AsyncFileWriter::Options ioOptions;
+};
+
+class OutputMuxer : public PacketSink {
+    // AV_TIME_BASE_Q is a C compound literal and does not compile as C++
+    static constexpr AVRational kMicroseconds = { 1, AV_TIME_BASE };
+
+public:
+    explicit OutputMuxer(const MuxerConfig& config) : config(config) {}
+
+    ~OutputMuxer() {
+        finish();
+        for (auto& s : streams) avcodec_parameters_free(&s.params);
+    }
+
+    // Whether encoders must put SPS/PPS (etc.) in extradata for this container
+    bool needsGlobalHeader() const {
+        const AVOutputFormat* fmt = av_guess_format(config.format.c_str(), nullptr, nullptr);
+        return fmt && (fmt->flags & AVFMT_GLOBALHEADER);
+    }
+
+    // Streams must be added (from opened encoders) before start(). Segments
+    // are cut on keyframes of the stream marked cutsSegments.
+    int addStream(const AVCodecContext* codecCtx, bool cutsSegments) {
+        StreamInfo info;
+        info.params = avcodec_parameters_alloc();
+        avcodec_parameters_from_context(info.params, codecCtx);
+        info.timeBase = codecCtx->time_base;
+        streams.push_back(info);
+        int index = (int)streams.size() - 1;
+        if (cutsSegments) cutStream = index;
+        return index;
+    }
+
+    // startUs becomes timestamp zero in the first file (default: the epoch)
+    bool start(int64_t startUs = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        segmentStartUs = startUs;
+        return openSegment();
+    }
+
+    int write(AVPacket* pkt, int streamIndex, AVRational codecTimeBase) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!ctx) return AVERROR(EINVAL);
+        int64_t timeUs = av_rescale_q(pkt->pts, codecTimeBase, kMicroseconds);
+        if (cutStream < 0 || (!config.segmentSeconds && !config.segmentBytes)) {
+            return writePacket(pkt, streamIndex, codecTimeBase, timeUs);
+        }
+
+        if (streamIndex != cutStream) {
+            HeldPacket held = { av_packet_alloc(), streamIndex, codecTimeBase, timeUs };
+            if (!held.pkt) return AVERROR(ENOMEM);
+            av_packet_move_ref(held.pkt, pkt);
+            heldBack.push_back(held);
+            // Without video for a while (a static desktop in VFR) the oldest
+            // audio goes out anyway; no cut can come before it by then
+            return releaseHeld(std::max(videoUs, timeUs - kMaxHoldUs));
+        }
+
+        if ((pkt->flags & AV_PKT_FLAG_KEY) && segmentDue(timeUs)) {
+            releaseHeld(timeUs - 1); // what is timed before the cut stays in this segment
+            closeSegment();
+            ++segmentIndex;
+            segmentStartUs = timeUs;
+            if (!openSegment()) return AVERROR(EIO);
+        }
+        videoUs = std::max(videoUs, timeUs);
+        int ret = writePacket(pkt, streamIndex, codecTimeBase, timeUs);
+        int released = releaseHeld(videoUs);
+        return ret < 0 ? ret : released;
+    }
+
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        releaseHeld(INT64_MAX);
+        closeSegment();
+    }
+
+    std::string firstFile() const { return segmentName(0); }
+    int segments() const { return segmentIndex + 1; }
+
+private:
+    struct StreamInfo {
+        AVCodecParameters* params = nullptr;
+        AVRational timeBase;
+    };
+
+    struct HeldPacket {
+        AVPacket* pkt;
+        int streamIndex;
+        AVRational codecTimeBase;
+        int64_t timeUs;
+    };
+
+    // Longer than the video can trail the audio by
+    static const int64_t kMaxHoldUs = 5000000;
+
+    // Writes the held packets timed at or before limitUs, oldest first
+    int releaseHeld(int64_t limitUs) {
+        int ret = 0;
+        while (!heldBack.empty() && heldBack.front().timeUs <= limitUs) {
+            HeldPacket held = heldBack.front();
+            heldBack.pop_front();
+            int r = ctx ? writePacket(held.pkt, held.streamIndex, held.codecTimeBase, held.timeUs) : AVERROR(EINVAL);
+            if (r < 0) ret = r;
+            av_packet_free(&held.pkt);
+        }
+        return ret;
+    }
+
+    int writePacket(AVPacket* pkt, int streamIndex, AVRational codecTimeBase, int64_t timeUs) {
+        // Audio from before the segment began (it arrived after the cut)
+        // would get a negative timestamp; it is dropped instead
+        if (streamIndex != cutStream && timeUs < segmentStartUs) return 0;
+
+        AVStream* stream = ctx->streams[streamIndex];
+        av_packet_rescale_ts(pkt, codecTimeBase, stream->time_base);
+        int64_t offset = av_rescale_q(segmentStartUs, kMicroseconds, stream->time_base);
+        if (pkt->pts != AV_NOPTS_VALUE) pkt->pts -= offset;
+        if (pkt->dts != AV_NOPTS_VALUE) pkt->dts -= offset;
+        pkt->stream_index = streamIndex;
+        int ret = av_interleaved_write_frame(ctx, pkt);
+
+        if (timeUs - lastFlushUs >= (int64_t)config.flushMs * 1000) {
+            av_write_frame(ctx, nullptr); // drain the muxer's own buffering
+            if (writer) writer->flush();
+            else avio_flush(ctx->pb);
+            lastFlushUs = timeUs;
+        }
+        return ret;
+    }
+
+    std::string segmentName(int index) const {
+        if (!config.segmentSeconds && !config.segmentBytes) return config.baseName + "." + config.extension;
+        std::ostringstream oss;
+        oss << config.baseName << "_" << std::setw(3) << std::setfill('0') << index << "." << config.extension;
+        return oss.str();
+    }
+
+    bool segmentDue(int64_t timeUs) const {
+        if (config.segmentSeconds && timeUs - segmentStartUs >= (int64_t)config.segmentSeconds * 1000000) return true;
+        if (config.segmentBytes && avio_tell(ctx->pb) >= config.segmentBytes) return true;
+        return false;
+    }
+
+    bool openSegment() {
+        std::string name = segmentName(segmentIndex);
+        if (avformat_alloc_output_context2(&ctx, nullptr, config.format.c_str(), name.c_str()) < 0) {
+            std::cerr << "Failed to allocate output context\n";
+            return false;
+        }
+        for (const StreamInfo& info : streams) {
+            AVStream* stream = avformat_new_stream(ctx, nullptr);
+            avcodec_parameters_copy(stream->codecpar, info.params);
+            stream->time_base = info.timeBase;
+        }
+        bool opened;
+        if (config.asyncIo) {
+            writer.reset(new AsyncFileWriter());
+            opened = writer->open(name, config.ioOptions);
+            if (opened) {
+                ctx->pb = writer->avio();
+                ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+            } else {
+                writer.reset();
+            }
+        } else {
+            opened = avio_open(&ctx->pb, name.c_str(), AVIO_FLAG_WRITE) >= 0;
+        }
+        if (!opened) {
+            std::cerr << "Failed to open output file " << name << "\n";
+            avformat_free_context(ctx);
+            ctx = nullptr;
+            return false;
+        }
+
+        AVDictionary* options = nullptr;
+        if (config.format == "mp4") {
+            // Self-contained fragments instead of one moov at the end
+            av_dict_set(&options, "movflags", "+frag_keyframe+empty_moov+default_base_moof", 0);
+            av_dict_set_int(&options, "frag_duration", (int64_t)config.flushMs * 1000, 0);
+        } else if (config.format == "matroska") {
+            av_dict_set_int(&options, "cluster_time_limit", config.flushMs, 0);
+        }
+        int ret = avformat_write_header(ctx, &options);
+        av_dict_free(&options);
+        if (ret < 0) {
+            std::cerr << "Error writing header\n";
+            closeOutput();
+            avformat_free_context(ctx);
+            ctx = nullptr;
+            return false;
+        }
+        lastFlushUs = segmentStartUs;
+        if (segmentIndex > 0) std::cout << "Segment: " << name << "\n";
+        return true;
+    }
+
+    void closeSegment() {
+        if (!ctx) return;
+        av_write_trailer(ctx);
+        closeOutput();
+        avformat_free_context(ctx);
+        ctx = nullptr;
+    }
+
+    void closeOutput() {
+        if (writer) {
+            writer->close();
+            writer.reset();
+            ctx->pb = nullptr;
+        } else {
+            avio_closep(&ctx->pb);
+        }
+    }
+
+    MuxerConfig config;
+    std::vector<StreamInfo> streams;
+    int cutStream = -1;
+    AVFormatContext* ctx = nullptr;
+    std::unique_ptr<AsyncFileWriter> writer;
+    int segmentIndex = 0;
+    int64_t segmentStartUs = 0; // subtracted from every timestamp in the segment
+    int64_t lastFlushUs = 0;
+    int64_t videoUs = INT64_MIN; // latest video time written
+    std::deque<HeldPacket> heldBack; // audio waiting for the video to pass it, in time order
+    std::mutex mutex;
+};
+
+// --- Replay buffer ---
+// Instead of writing to disk, the encoders' packets go into a fixed-size
+// byte arena, oldest whole GOP evicted first, so it always holds the last
+// maxSeconds (or as much as fits in the arena) starting on a video keyframe.
+// snapshot() copies the contents out under the lock so the dump can be
+// written on another thread while recording continues.
+class ReplayBuffer : public PacketSink {
+public:
+    struct Packet {
+        AVPacket* pkt;
+        int streamIndex;
+        AVRational timeBase;
+    };
+
+    ReplayBuffer(size_t arenaBytes, int maxSeconds, int videoStream)
+        : arena(arenaBytes), maxUs((int64_t)maxSeconds * 1000000), videoStream(videoStream) {}
+
+    int write(AVPacket* pkt, int streamIndex, AVRational codecTimeBase) override {
+        size_t size = (size_t)pkt->size;
+        bool keyframe = streamIndex == videoStream && (pkt->flags & AV_PKT_FLAG_KEY);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (size == 0 || size > arena.size() / 4) { // degenerate or absurdly large
+            // A lost video packet breaks decoding up to the next keyframe
+            if (streamIndex == videoStream) waitingForKey = true;
+            return 0;
+        }
+        // Nothing is useful before a video keyframe
+        if (keyframe) {
+            waitingForKey = false;
+        } else if (waitingForKey) {
+            return 0;
+        }
+        Entry e;
+        e.streamIndex = streamIndex;
+        e.timeBase = codecTimeBase;
+        e.pts = pkt->pts;
+        e.dts = pkt->dts;
+        e.duration = pkt->duration;
+        e.flags = pkt->flags;
+        e.size = size;
+        e.timeUs = av_rescale_q(pkt->pts, codecTimeBase, AVRational{ 1, AV_TIME_BASE });
+
+        newestUs = std::max(newestUs, e.timeUs);
+        // Age limit, checked at keyframes so a whole GOP goes at once
+        while (keyframe && !entries.empty() && e.timeUs - entries.front().timeUs > maxUs &&
+               secondKeyframeBefore(e.timeUs - maxUs)) {
+            evictGop();
+        }
+        e.offset = allocate(size);
+        if (entries.empty() && !keyframe) {
+            // A GOP larger than the arena evicted itself: start over at the next keyframe
+            waitingForKey = true;
+            return 0;
+        }
+        memcpy(arena.data() + e.offset, pkt->data, size);
+        entries.push_back(e);
+        return 0;
+    }
+
+    // Copies of everything held, oldest first, in the codec time bases
+    std::vector<Packet> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Packet> out;
+        out.reserve(entries.size());
+        for (const Entry& e : entries) {
+            AVPacket* pkt = av_packet_alloc();
+            av_new_packet(pkt, (int)e.size);
+            memcpy(pkt->data, arena.data() + e.offset, e.size);
+            pkt->pts = e.pts;
+            pkt->dts = e.dts;
+            pkt->duration = e.duration;
+            pkt->flags = e.flags;
+            out.push_back({ pkt, e.streamIndex, e.timeBase });
+        }
+        return out;
+    }
+
+    double seconds() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.empty() ? 0 : (newestUs - entries.front().timeUs) / 1e6;
+    }
+
+private:
+    struct Entry {
+        size_t offset, size;
+        int streamIndex;
+        AVRational timeBase;
+        int64_t pts, dts, duration, timeUs;
+        int flags;
+    };
+
+    bool isKey(const Entry& e) const { return e.streamIndex == videoStream && (e.flags & AV_PKT_FLAG_KEY); }
+
+    // True if a keyframe after the oldest one is at or before limitUs, i.e.
+    // evicting the oldest GOP still leaves at least maxSeconds
+    bool secondKeyframeBefore(int64_t limitUs) const {
+        for (size_t i = 1; i < entries.size(); ++i) {
+            if (isKey(entries[i])) return entries[i].timeUs <= limitUs;
+        }
+        return false;
+    }
+
+    // Drops the oldest GOP: the leading keyframe and everything up to the next
+    void evictGop() {
+        do {
+            entries.pop_front();
+        } while (!entries.empty() && !isKey(entries.front()));
+    }
+
+    // Ring allocation in the arena: append after the newest packet, wrapping
+    // to the start when the end is too short, evicting GOPs that are in the way
+    size_t allocate(size_t size) {
+        for (;;) {
+            if (entries.empty()) return 0;
+            size_t head = entries.front().offset;
+            size_t tail = entries.back().offset + entries.back().size;
+            if (tail >= head) {
+                if (arena.size() - tail >= size) return tail;
+                if (head >= size) return 0; // wrap
+            } else if (head - tail >= size) {
+                return tail;
+            }
+            evictGop();
+        }
+    }
+
+    std::vector<uint8_t> arena;
+    std::deque<Entry> entries;
+    int64_t maxUs;
+    int videoStream;
+    int64_t newestUs = 0;
+    bool waitingForKey = true; // drop everything until the next video keyframe
+    std::mutex mutex;
+};
+
+// --- Loopback audio ---
+// WASAPI loopback of the default render device, encoded to AAC on its own
+// thread. Sample 0 is the shared QPC epoch that video PTS also count from,
+// and each packet's QPC position places it on that timeline: gaps (loopback
+// delivers nothing while nothing plays) are filled with silence and overlaps
+// are trimmed, so the audio track stays continuous and in sync.
+class AudioCapture {
+public:
+    ~AudioCapture() {
+        stop();
+        if (fifo) av_audio_fifo_free(fifo);
+        swr_free(&swrCtx);
+        av_frame_free(&encodeFrame);
+        avcodec_free_context(&codecCtx);
+        if (mixFormat) CoTaskMemFree(mixFormat);
+        if (audioEvent) CloseHandle(audioEvent);
+        if (stopEvent) CloseHandle(stopEvent);
+    }
+
+    // COM must already be initialised (multithreaded) on the calling thread.
+    // codecName is "aac" or "opus".
+    bool init(bool globalHeader, const std::string& codecName) {
+        ComPtr<IMMDeviceEnumerator> enumerator;
+        ComPtr<IMMDevice> device;
+        if (FAILED(CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_ALL,
+                                    __uuidof(IMMDeviceEnumerator), (void**)enumerator.GetAddressOf()))) return false;
+        if (FAILED(enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device))) return false;
+        if (FAILED(device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void**)audioClient.GetAddressOf()))) return false;
+        if (FAILED(audioClient->GetMixFormat(&mixFormat))) return false;
+
+        AVSampleFormat inFormat = mixSampleFormat();
+        if (inFormat == AV_SAMPLE_FMT_NONE) {
+            std::cerr << "Unsupported audio mix format\n";
+            return false;
+        }
+
+        audioEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        stopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        const REFERENCE_TIME bufferDuration = 100 * 10000; // 100 ms of headroom, in hns
+        eventDriven = SUCCEEDED(audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
+                                                        AUDCLNT_STREAMFLAGS_LOOPBACK | AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+                                                        bufferDuration, 0, mixFormat, nullptr)) &&
+                      SUCCEEDED(audioClient->SetEventHandle(audioEvent));
+        if (!eventDriven) {
+            // Pre-1703 loopback has no event mode; a client initialises only once
+            audioClient.Reset();
+            if (FAILED(device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void**)audioClient.GetAddressOf())) ||
+                FAILED(audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, AUDCLNT_STREAMFLAGS_LOOPBACK,
+                                               bufferDuration, 0, mixFormat, nullptr))) return false;
+        }
+        if (FAILED(audioClient->GetService(__uuidof(IAudioCaptureClient), (void**)captureClient.GetAddressOf()))) return false;
+
+        const AVCodec* codec = codecName == "opus" ? avcodec_find_encoder_by_name("libopus")
+                                                   : avcodec_find_encoder(AV_CODEC_ID_AAC);
+        if (!codec) return false;
+        codecCtx = avcodec_alloc_context3(codec);
+        codecCtx->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+        codecCtx->sample_rate = pickSampleRate(codec, inputRate());
+        av_channel_layout_default(&codecCtx->ch_layout, mixFormat->nChannels);
+        codecCtx->bit_rate = 64000 * std::min<int>(mixFormat->nChannels, 6);
+        codecCtx->time_base = { 1, codecCtx->sample_rate };
+        if (globalHeader) codecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        if (avcodec_open2(codecCtx, codec, nullptr) < 0) return false;
+
+        // Usually only reformats; resamples when the codec cannot take the
+        // mix rate (Opus runs at 48 kHz)
+        if (swr_alloc_set_opts2(&swrCtx, &codecCtx->ch_layout, codecCtx->sample_fmt, codecCtx->sample_rate,
+                                &codecCtx->ch_layout, inFormat, inputRate(), 0, nullptr) < 0 ||
+            swr_init(swrCtx) < 0) return false;
+        fifo = av_audio_fifo_alloc(codecCtx->sample_fmt, mixFormat->nChannels, codecCtx->frame_size * 4);
+
+        encodeFrame = av_frame_alloc();
+        encodeFrame->format = codecCtx->sample_fmt;
+        encodeFrame->sample_rate = codecCtx->sample_rate;
+        encodeFrame->nb_samples = codecCtx->frame_size;
+        av_channel_layout_copy(&encodeFrame->ch_layout, &codecCtx->ch_layout);
+        av_frame_get_buffer(encodeFrame, 0);
+        return true;
+    }
+
+    AVCodecContext* codecContext() const { return codecCtx; }
+    int channels() const { return mixFormat->nChannels; }
+    int sampleRate() const { return codecCtx->sample_rate; }
+    int inputRate() const { return (int)mixFormat->nSamplesPerSec; }
+
+    // epochQpc is the QPC tick that maps to audio sample 0
+    bool start(PacketSink* muxer, int streamIndex, int64_t epochQpc) {
+        this->muxer = muxer;
+        this->streamIndex = streamIndex;
+        epochHns = av_rescale(epochQpc, 10000000, qpcFrequency());
+        if (FAILED(audioClient->Start())) return false;
+        worker = std::thread(&AudioCapture::run, this);
+        return true;
+    }
+
+    // Stops capture, then encodes whatever is still buffered and flushes
+    void stop() {
+        if (!worker.joinable()) return;
+        SetEvent(stopEvent);
+        worker.join();
+        audioClient->Stop();
+        convertChunk(nullptr, 0); // resampler tail
+        encodeBuffered(true);
+        avcodec_send_frame(codecCtx, nullptr);
+        drainPackets();
+    }
+
+private:
+    static int pickSampleRate(const AVCodec* codec, int mixRate) {
+        if (!codec->supported_samplerates) return mixRate;
+        for (const int* r = codec->supported_samplerates; *r; ++r) {
+            if (*r == mixRate) return mixRate;
+        }
+        for (const int* r = codec->supported_samplerates; *r; ++r) {
+            if (*r == 48000) return 48000;
+        }
+        return codec->supported_samplerates[0];
+    }
+
+    AVSampleFormat mixSampleFormat() const {
+        bool isFloat = mixFormat->wFormatTag == WAVE_FORMAT_IEEE_FLOAT;
+        bool isPcm = mixFormat->wFormatTag == WAVE_FORMAT_PCM;
+        if (mixFormat->wFormatTag == WAVE_FORMAT_EXTENSIBLE) {
+            const WAVEFORMATEXTENSIBLE* ext = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(mixFormat);
+            isFloat = ext->SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+            isPcm = ext->SubFormat == KSDATAFORMAT_SUBTYPE_PCM;
+        }
+        if (isFloat && mixFormat->wBitsPerSample == 32) return AV_SAMPLE_FMT_FLT;
+        if (isPcm && mixFormat->wBitsPerSample == 16) return AV_SAMPLE_FMT_S16;
+        return AV_SAMPLE_FMT_NONE;
+    }
+
+    void run() {
+        CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+        ScopedThreadPolicy policy(ThreadRole::Audio);
+        DWORD mmcssTask = 0;
+        HANDLE mmcss = AvSetMmThreadCharacteristicsW(L"Pro Audio", &mmcssTask);
+
+        HANDLE handles[2] = { stopEvent, audioEvent };
+        DWORD count = eventDriven ? 2 : 1;
+        DWORD timeout = eventDriven ? 100 : 10;
+        bool running = true;
+        while (running) {
+            if (WaitForMultipleObjects(count, handles, FALSE, timeout) == WAIT_OBJECT_0) running = false;
+
+            bool gotPacket = false;
+            UINT32 packetLength = 0;
+            while (SUCCEEDED(captureClient->GetNextPacketSize(&packetLength)) && packetLength != 0) {
+                BYTE* data = nullptr;
+                UINT32 frames = 0;
+                DWORD flags = 0;
+                UINT64 qpcPosition = 0; // 100 ns units
+                if (FAILED(captureClient->GetBuffer(&data, &frames, &flags, nullptr, &qpcPosition))) break;
+                if (!(flags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR)) {
+                    int64_t skip = alignTo(sampleAt((int64_t)qpcPosition));
+                    if (skip < frames) {
+                        const BYTE* start = data + skip * mixFormat->nBlockAlign;
+                        pushSamples((flags & AUDCLNT_BUFFERFLAGS_SILENT) ? nullptr : start, (int)(frames - skip));
+                    }
+                } else {
+                    pushSamples((flags & AUDCLNT_BUFFERFLAGS_SILENT) ? nullptr : data, (int)frames);
+                }
+                captureClient->ReleaseBuffer(frames);
+                gotPacket = true;
+            }
+
+            // Nothing playing: keep the track advancing, a little behind real
+            // time so a late packet does not have to be trimmed
+            if (!gotPacket && running) {
+                int64_t behind = sampleAt(av_rescale(qpcNow(), 10000000, qpcFrequency())) - inputRate() / 10;
+                if (behind > nextSample) pushSamples(nullptr, (int)(behind - nextSample));
+            }
+            encodeBuffered(false);
+        }
+
+        if (mmcss) AvRevertMmThreadCharacteristics(mmcss);
+        CoUninitialize();
+    }
+
+    int64_t sampleAt(int64_t hns) const {
+        return (hns - epochHns) * inputRate() / 10000000;
+    }
+
+    // Brings nextSample to a packet that starts at sample target. Returns
+    // how many of the packet's leading frames overlap what was already
+    // written and must be skipped.
+    int64_t alignTo(int64_t target) {
+        const int64_t tolerance = inputRate() / 50; // 20 ms of clock jitter
+        int64_t drift = target - nextSample;
+        if (drift > tolerance) {
+            pushSamples(nullptr, (int)drift);
+            return 0;
+        }
+        return drift < -tolerance ? -drift : 0;
+    }
+
+    static const int kChunk = 4096; // input frames converted per swr_convert call
+
+    // Interleaved mix-format samples into the encoder FIFO; nullptr = silence
+    void pushSamples(const BYTE* data, int frames) {
+        while (frames > 0) {
+            int n = std::min(frames, kChunk);
+            const BYTE* src = data;
+            if (!src) {
+                silence.resize((size_t)kChunk * mixFormat->nBlockAlign);
+                src = silence.data();
+            }
+            convertChunk(src, n);
+            nextSample += n;
+            if (data) data += (size_t)n * mixFormat->nBlockAlign;
+            frames -= n;
+        }
+    }
+
+    // One swr_convert into the FIFO; src == nullptr drains the resampler
+    void convertChunk(const BYTE* src, int n) {
+        if (converted.empty()) {
+            // Room for a resampled chunk plus the resampler's delay
+            outCapacity = (int)av_rescale_rnd(kChunk, sampleRate(), inputRate(), AV_ROUND_UP) + 256;
+            size_t sampleBytes = av_get_bytes_per_sample(codecCtx->sample_fmt);
+            bool planar = av_sample_fmt_is_planar(codecCtx->sample_fmt) != 0;
+            size_t planeBytes = (size_t)outCapacity * sampleBytes * (planar ? 1 : channels());
+            int planeCount = planar ? channels() : 1;
+            converted.resize(planeBytes * planeCount);
+            planes.resize(planeCount);
+            for (int c = 0; c < planeCount; ++c) planes[c] = converted.data() + c * planeBytes;
+        }
+        int out = swr_convert(swrCtx, planes.data(), outCapacity, src ? &src : nullptr, src ? n : 0);
+        if (out > 0) av_audio_fifo_write(fifo, (void**)planes.data(), out);
+    }
+
+    // Encodes every full frame in the FIFO (and the partial tail on flush)
+    void encodeBuffered(bool flush) {
+        while (av_audio_fifo_size(fifo) >= codecCtx->frame_size ||
+               (flush && av_audio_fifo_size(fifo) > 0)) {
+            av_frame_make_writable(encodeFrame);
+            int n = av_audio_fifo_read(fifo, (void**)encodeFrame->data, codecCtx->frame_size);
+            encodeFrame->nb_samples = n;
+            encodeFrame->pts = encodedSamples;
+            encodedSamples += n;
+            if (avcodec_send_frame(codecCtx, encodeFrame) < 0) {
+                std::cerr << "Error sending audio frame to encoder\n";
+                return;
+            }
+            drainPackets();
+        }
+    }
+
+    void drainPackets() {
+        AVPacket pkt = {};
+        while (avcodec_receive_packet(codecCtx, &pkt) == 0) {
+            muxer->write(&pkt, streamIndex, codecCtx->time_base);
+            av_packet_unref(&pkt);
+        }
+    }
+
+    ComPtr<IAudioClient> audioClient;
+    ComPtr<IAudioCaptureClient> captureClient;
+    WAVEFORMATEX* mixFormat = nullptr;
+    bool eventDriven = false;
+    HANDLE audioEvent = nullptr;
+    HANDLE stopEvent = nullptr;
+    AVCodecContext* codecCtx = nullptr;
+    SwrContext* swrCtx = nullptr;
+    AVAudioFifo* fifo = nullptr;
+    AVFrame* encodeFrame = nullptr;
+    std::vector<BYTE> silence;
+    std::vector<uint8_t> converted;
+    std::vector<uint8_t*> planes;
+    int outCapacity = 0;
+    int64_t epochHns = 0;
+    int64_t nextSample = 0;     // samples pushed so far, silence included
+    int64_t encodedSamples = 0; // samples handed to the encoder
+    PacketSink* muxer = nullptr;
+    int streamIndex = -1;
+    std::thread worker;
+};
+
+// --- Options ---
+// sws_scale filter by name, 0 if unknown
+int scalerFlags(const std::string& name) {
+    if (name == "fast-bilinear") return SWS_FAST_BILINEAR;
+    if (name == "bilinear") return SWS_BILINEAR;
+    if (name == "bicubic") return SWS_BICUBIC;
+    if (name == "area") return SWS_AREA;
+    if (name == "lanczos") return SWS_LANCZOS;
+    return 0;
+}
+
+struct RecorderOptions {
+    int fps = 30;             // capture slots per second and nominal encoder rate
+    int bitrateKbps = 12000;  // encoder target and VBV rate
+    int gop = 120;            // frames between keyframes
+    std::string x264Preset = "ultrafast";
+    std::string x264Tune = "fastdecode"; // "" = none
+    int poolSize = 50;        // frames between capture and encoder
+    std::string poolPages = "normal"; // frame arena backing: "normal", "locked" or "large"
+    std::string scaler = "fast-bilinear"; // sws_scale filter
+    bool cursor = true;       // draw the mouse pointer into the recording
+    std::string staticFrames; // unchanged frames: "encode", "repeat" or "skip"; "" = skip with --vfr, else repeat
+    bool sampledHash = false; // judge unchanged frames by every fourth row only
+    int crf = 0;              // libx264 CRF capped at the bitrate, 0 = bitrate mode
+    bool adaptive = false;    // trade quality, then frame rate, for keeping up
+    int maxCrf = 0;           // adaptive CRF ceiling, 0 = crf + 8
+    int minFps = 0;           // adaptive frame rate floor, 0 = half of fps
+    int stagingRingSize = 3; // staging textures in flight between copy and map
+    bool gpuConvert = false; // BGRA -> NV12 on the GPU instead of sws_scale
+    std::string hwEncoder;   // "", "auto", "nvenc", "qsv" or "amf"
+    bool dirtyRects = false; // copy and convert only what DXGI reports as changed
+    WaitStrategy waitStrategy = WaitStrategy::Futex; // how the encoder waits for frames
+    Backpressure backpressure = Backpressure::DropNewest; // what to do when the pool is empty
+    int blockTimeoutMs = 100; // longest wait for a free frame with Backpressure::Block
+    int outputWidth = 0;      // encoded size; 0 = desktop size (or scaled by outputScale)
+    int outputHeight = 0;
+    double outputScale = 0;   // fraction of the desktop size, 0 = unscaled
+    int x264Threads = 0;      // libx264 threads, 0 = spare cores
+    int convertThreads = 0;   // sws_scale slice workers, 0 = a quarter of the cores, at most 4
+    int timerResolutionMs = -1; // timeBeginPeriod while recording; -1 = 1 ms without high-resolution timers, 0 = leave it
+    std::string captureCores; // core lists like "0-3,6" per thread role, "" = pipeline block or any
+    std::string encoderCores;
+    std::string writerCores;
+    std::string audioCores;
+    bool cpuSets = false;     // apply the core lists as CPU sets (a soft preference)
+    bool mmcss = false;       // capture threads in the MMCSS "Capture" task
+    bool ecoEncoder = false;  // encoder threads below normal priority with EcoQoS
+    std::string x264ThreadType = "slice"; // "slice" (no added latency) or "frame"
+    int rcLookahead = -1;     // libx264 rc-lookahead, -1 = preset default
+    bool audio = true;        // mux WASAPI loopback audio alongside the video
+    bool vfr = false;         // exact present-time PTS, no frames while the desktop is static
+    std::string container;    // "avi", "mkv" or "mp4"; "" = avi, or mkv with --vfr
+    int flushMs = 1000;       // fragment/cluster length and flush interval (mkv/mp4)
+    int segmentMinutes = 0;   // start a new file every N minutes, 0 = never
+    int segmentMB = 0;        // start a new file every N MB, 0 = never
+    std::string audioCodec = "aac"; // "aac" or "opus"
+    bool asyncIo = false;     // write through AsyncFileWriter
+    int ioBlockMB = 4;        // AsyncFileWriter block size
+    bool noBuffering = false; // FILE_FLAG_NO_BUFFERING for full blocks
+    int preallocMB = 0;       // disk space reserved per output file
+    int replaySeconds = 0;    // keep the last N seconds in memory instead of recording, 0 = off
+    int replayMB = 512;       // replay buffer arena size
+    std::string outputs = "0:0"; // "adapter:output,..." or "all", one pipeline each
+    bool composite = false;   // one stream of all selected outputs instead
+    bool listOutputs = false; // print the outputs and exit
+    std::string benchmark;    // "static", "scroll" or "noise": run the synthetic benchmark instead
+    int benchWidth = 1920;
+    int benchHeight = 1080;
+    int benchFps = 0;         // benchmark frame rate, 0 = as fast as the encoder goes
+    int benchSeconds = 10;
+    std::string telemetry;      // shared-memory block name for live counters, "" = none
+    std::string telemetryPrint; // print that block of a running recorder and exit
+};
+
+// Applies flags in order, so a later one overrides an earlier one
+bool parseArguments(const std::vector<std::string>& args, RecorderOptions& opts) {
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        bool hasValue = i + 1 < args.size();
+        if (arg == "--fps" && hasValue) {
+            opts.fps = std::atoi(args[++i].c_str());
+        } else if (arg == "--bitrate-kbps" && hasValue) {
+            opts.bitrateKbps = std::atoi(args[++i].c_str());
+        } else if (arg == "--gop" && hasValue) {
+            opts.gop = std::atoi(args[++i].c_str());
+        } else if (arg == "--x264-preset" && hasValue) {
+            opts.x264Preset = args[++i];
+        } else if (arg == "--x264-tune" && hasValue) {
+            opts.x264Tune = args[++i];
+            if (opts.x264Tune == "none") opts.x264Tune.clear();
+        } else if (arg == "--pool-size" && hasValue) {
+            opts.poolSize = std::atoi(args[++i].c_str());
+        } else if (arg == "--pool-pages" && hasValue) {
+            opts.poolPages = args[++i];
+        } else if (arg == "--crf" && hasValue) {
+            opts.crf = std::atoi(args[++i].c_str());
+        } else if (arg == "--adaptive") {
+            opts.adaptive = true;
+        } else if (arg == "--max-crf" && hasValue) {
+            opts.maxCrf = std::atoi(args[++i].c_str());
+        } else if (arg == "--min-fps" && hasValue) {
+            opts.minFps = std::atoi(args[++i].c_str());
+        } else if (arg == "--no-cursor") {
+            opts.cursor = false;
+        } else if (arg == "--static-frames" && hasValue) {
+            opts.staticFrames = args[++i];
+        } else if (arg == "--sampled-hash") {
+            opts.sampledHash = true;
+        } else if (arg == "--scaler" && hasValue) {
+            opts.scaler = args[++i];
+        } else if (arg == "--staging-ring" && hasValue) {
+            opts.stagingRingSize = std::atoi(args[++i].c_str());
+        } else if (arg == "--gpu-convert") {
+            opts.gpuConvert = true;
+        } else if (arg == "--hw-encoder" && hasValue) {
+            opts.hwEncoder = args[++i];
+        } else if (arg == "--dirty-rects") {
+            opts.dirtyRects = true;
+        } else if (arg == "--wait" && hasValue) {
+            std::string mode = args[++i];
+            if (mode == "spin") opts.waitStrategy = WaitStrategy::Spin;
+            else if (mode == "yield") opts.waitStrategy = WaitStrategy::Yield;
+            else if (mode == "futex") opts.waitStrategy = WaitStrategy::Futex;
+            else {
+                std::cerr << "--wait must be spin, yield or futex\n";
+                return false;
+            }
+        } else if (arg == "--backpressure" && hasValue) {
+            std::string mode = args[++i];
+            if (mode == "drop-newest") opts.backpressure = Backpressure::DropNewest;
+            else if (mode == "drop-oldest") opts.backpressure = Backpressure::DropOldest;
+            else if (mode == "duplicate") opts.backpressure = Backpressure::Duplicate;
+            else if (mode == "block") opts.backpressure = Backpressure::Block;
+            else {
+                std::cerr << "--backpressure must be drop-newest, drop-oldest, duplicate or block\n";
+                return false;
+            }
+        } else if (arg == "--block-timeout-ms" && hasValue) {
+            opts.blockTimeoutMs = std::atoi(args[++i].c_str());
+        } else if (arg == "--output-size" && hasValue) {
+            if (std::sscanf(args[++i].c_str(), "%dx%d", &opts.outputWidth, &opts.outputHeight) != 2) {
+                std::cerr << "--output-size must look like 1920x1080\n";
+                return false;
+            }
+        } else if (arg == "--scale" && hasValue) {
+            opts.outputScale = std::atof(args[++i].c_str());
+        } else if (arg == "--convert-threads" && hasValue) {
+            opts.convertThreads = std::atoi(args[++i].c_str());
+        } else if (arg == "--timer-resolution" && hasValue) {
+            opts.timerResolutionMs = std::atoi(args[++i].c_str());
+        } else if (arg == "--capture-cores" && hasValue) {
+            opts.captureCores = args[++i];
+        } else if (arg == "--encoder-cores" && hasValue) {
+            opts.encoderCores = args[++i];
+        } else if (arg == "--writer-cores" && hasValue) {
+            opts.writerCores = args[++i];
+        } else if (arg == "--audio-cores" && hasValue) {
+            opts.audioCores = args[++i];
+        } else if (arg == "--cpu-sets") {
+            opts.cpuSets = true;
+        } else if (arg == "--mmcss") {
+            opts.mmcss = true;
+        } else if (arg == "--eco-encoder") {
+            opts.ecoEncoder = true;
+        } else if (arg == "--x264-threads" && hasValue) {
+            opts.x264Threads = std::atoi(args[++i].c_str());
+        } else if (arg == "--x264-thread-type" && hasValue) {
+            opts.x264ThreadType = args[++i];
+        } else if (arg == "--rc-lookahead" && hasValue) {
+            opts.rcLookahead = std::atoi(args[++i].c_str());
+        } else if (arg == "--no-audio") {
+            opts.audio = false;
+        } else if (arg == "--vfr") {
+            opts.vfr = true;
+        } else if (arg == "--container" && hasValue) {
+            opts.container = args[++i];
+        } else if (arg == "--flush-ms" && hasValue) {
+            opts.flushMs = std::atoi(args[++i].c_str());
+        } else if (arg == "--segment-minutes" && hasValue) {
+            opts.segmentMinutes = std::atoi(args[++i].c_str());
+        } else if (arg == "--segment-mb" && hasValue) {
+            opts.segmentMB = std::atoi(args[++i].c_str());
+        } else if (arg == "--audio-codec" && hasValue) {
+            opts.audioCodec = args[++i];
+        } else if (arg == "--replay-seconds" && hasValue) {
+            opts.replaySeconds = std::atoi(args[++i].c_str());
+        } else if (arg == "--replay-mb" && hasValue) {
+            opts.replayMB = std::atoi(args[++i].c_str());
+        } else if (arg == "--outputs" && hasValue) {
+            opts.outputs = args[++i];
+        } else if (arg == "--composite") {
+            opts.composite = true;
+        } else if (arg == "--list-outputs") {
+            opts.listOutputs = true;
+        } else if (arg == "--benchmark" && hasValue) {
+            opts.benchmark = args[++i];
+        } else if (arg == "--bench-size" && hasValue) {
+            if (std::sscanf(args[++i].c_str(), "%dx%d", &opts.benchWidth, &opts.benchHeight) != 2) {
+                std::cerr << "--bench-size must look like 1920x1080\n";
+                return false;
+            }
+        } else if (arg == "--bench-fps" && hasValue) {
+            opts.benchFps = std::atoi(args[++i].c_str());
+        } else if (arg == "--bench-seconds" && hasValue) {
+            opts.benchSeconds = std::atoi(args[++i].c_str());
+        } else if (arg == "--telemetry" && hasValue) {
+            opts.telemetry = args[++i];
+        } else if (arg == "--telemetry-print" && hasValue) {
+            opts.telemetryPrint = args[++i];
+        } else if (arg == "--async-io") {
+            opts.asyncIo = true;
+        } else if (arg == "--io-block-mb" && hasValue) {
+            opts.ioBlockMB = std::atoi(args[++i].c_str());
+        } else if (arg == "--no-buffering") {
+            opts.noBuffering = opts.asyncIo = true;
+        } else if (arg == "--prealloc-mb" && hasValue) {
+            opts.preallocMB = std::atoi(args[++i].c_str());
+            opts.asyncIo = true;
+        } else {
+            std::cerr << "Unknown or incomplete option: " << arg << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks values and the combinations that would fail or silently do
+// nothing later on, so a bad preset or profile stops the recorder at startup
+bool validateOptions(RecorderOptions& opts) {
+    if (opts.fps < 1 || opts.fps > 240) {
+        std::cerr << "--fps must be between 1 and 240\n";
+        return false;
+    }
+    if (opts.bitrateKbps < 100 || opts.bitrateKbps > 500000) {
+        std::cerr << "--bitrate-kbps must be between 100 and 500000\n";
+        return false;
+    }
+    if (opts.gop < 1 || opts.gop > 3000) {
+        std::cerr << "--gop must be between 1 and 3000\n";
+        return false;
+    }
+    static const char* x264Presets[] = { "ultrafast", "superfast", "veryfast", "faster", "fast",
+                                         "medium", "slow", "slower", "veryslow" };
+    if (std::find(std::begin(x264Presets), std::end(x264Presets), opts.x264Preset) == std::end(x264Presets)) {
+        std::cerr << "--x264-preset must be one of ultrafast ... veryslow\n";
+        return false;
+    }
+    static const char* x264Tunes[] = { "", "film", "animation", "grain", "stillimage", "psnr", "ssim",
+                                       "fastdecode", "zerolatency" };
+    if (std::find(std::begin(x264Tunes), std::end(x264Tunes), opts.x264Tune) == std::end(x264Tunes)) {
+        std::cerr << "--x264-tune must be none, film, animation, grain, stillimage, psnr, ssim, fastdecode or zerolatency\n";
+        return false;
+    }
+    if (opts.poolSize < 4 || opts.poolSize > 256) {
+        std::cerr << "--pool-size must be between 4 and 256\n";
+        return false;
+    }
+    if (opts.poolPages != "normal" && opts.poolPages != "locked" && opts.poolPages != "large") {
+        std::cerr << "--pool-pages must be normal, locked or large\n";
+        return false;
+    }
+    if (opts.crf < 0 || opts.crf > 51) {
+        std::cerr << "--crf must be between 1 and 51, or 0 for bitrate mode\n";
+        return false;
+    }
+    if (opts.maxCrf == 0 && opts.crf) opts.maxCrf = std::min(51, opts.crf + 8);
+    if (opts.crf && (opts.maxCrf < opts.crf || opts.maxCrf > 51)) {
+        std::cerr << "--max-crf must be between --crf and 51\n";
+        return false;
+    }
+    if (opts.minFps == 0) opts.minFps = std::max(1, opts.fps / 2);
+    if (opts.minFps < 1 || opts.minFps > opts.fps) {
+        std::cerr << "--min-fps must be between 1 and --fps\n";
+        return false;
+    }
+    if (opts.staticFrames.empty()) opts.staticFrames = opts.vfr ? "skip" : "repeat";
+    if (opts.staticFrames != "encode" && opts.staticFrames != "repeat" && opts.staticFrames != "skip") {
+        std::cerr << "--static-frames must be encode, repeat or skip\n";
+        return false;
+    }
+    if (scalerFlags(opts.scaler) == 0) {
+        std::cerr << "--scaler must be fast-bilinear, bilinear, bicubic, area or lanczos\n";
+        return false;
+    }
+    if (opts.stagingRingSize < 1 || opts.stagingRingSize > 16) {
+        std::cerr << "--staging-ring must be between 1 and 16\n";
+        return false;
+    }
+    if (!opts.hwEncoder.empty() && opts.hwEncoder != "auto" && opts.hwEncoder != "nvenc" &&
+        opts.hwEncoder != "qsv" && opts.hwEncoder != "amf") {
+        std::cerr << "--hw-encoder must be auto, nvenc, qsv or amf\n";
+        return false;
+    }
+    if (opts.blockTimeoutMs < 1) {
+        std::cerr << "--block-timeout-ms must be positive\n";
+        return false;
+    }
+    if (opts.outputWidth || opts.outputHeight) {
+        if (opts.outputWidth < 16 || opts.outputHeight < 16) {
+            std::cerr << "--output-size must be at least 16x16\n";
+            return false;
+        }
+        if (opts.outputScale != 0) {
+            std::cerr << "--output-size and --scale are exclusive\n";
+            return false;
+        }
+    }
+    if (opts.outputScale < 0 || opts.outputScale > 1) {
+        std::cerr << "--scale must be between 0 and 1\n";
+        return false;
+    }
+    if (opts.x264Threads < 0 || opts.x264Threads > 64) {
+        std::cerr << "--x264-threads must be between 0 and 64\n";
+        return false;
+    }
+    if (opts.convertThreads < 0 || opts.convertThreads > 16) {
+        std::cerr << "--convert-threads must be between 0 and 16\n";
+        return false;
+    }
+    if (opts.timerResolutionMs < -1 || opts.timerResolutionMs > 15) {
+        std::cerr << "--timer-resolution must be between 0 and 15\n";
+        return false;
+    }
+    const std::pair<const char*, const std::string*> coreLists[] = {
+        { "--capture-cores", &opts.captureCores }, { "--encoder-cores", &opts.encoderCores },
+        { "--writer-cores", &opts.writerCores }, { "--audio-cores", &opts.audioCores } };
+    for (const auto& list : coreLists) {
+        DWORD_PTR mask = 0;
+        if (!list.second->empty() && !parseCoreList(*list.second, mask)) {
+            std::cerr << list.first << " must list existing cores, like 0-3,6\n";
+            return false;
+        }
+    }
+    if (opts.x264ThreadType != "slice" && opts.x264ThreadType != "frame") {
+        std::cerr << "--x264-thread-type must be slice or frame\n";
+        return false;
+    }
+    if (opts.x264Tune == "zerolatency" && opts.x264ThreadType == "frame") {
+        // zerolatency turns frame threads off again
+        std::cerr << "--x264-tune zerolatency needs --x264-thread-type slice\n";
+        return false;
+    }
+    if (opts.rcLookahead < -1 || opts.rcLookahead > 250) {
+        std::cerr << "--rc-lookahead must be between 0 and 250\n";
+        return false;
+    }
+    if (opts.container.empty()) opts.container = opts.vfr ? "mkv" : "avi";
+    if (opts.container != "avi" && opts.container != "mkv" && opts.container != "mp4") {
+        std::cerr << "--container must be avi, mkv or mp4\n";
+        return false;
+    }
+    if (opts.vfr && opts.container == "avi") {
+        std::cerr << "--vfr needs --container mkv or mp4\n";
+        return false;
+    }
+    if (opts.flushMs < 100 || opts.flushMs > 60000) {
+        std::cerr << "--flush-ms must be between 100 and 60000\n";
+        return false;
+    }
+    if (opts.segmentMinutes < 0 || opts.segmentMB < 0) {
+        std::cerr << "--segment-minutes and --segment-mb must not be negative\n";
+        return false;
+    }
+    if (opts.audioCodec != "aac" && opts.audioCodec != "opus") {
+        std::cerr << "--audio-codec must be aac or opus\n";
+        return false;
+    }
+    if (opts.audioCodec == "opus" && opts.container == "avi") {
+        std::cerr << "Opus audio needs --container mkv or mp4\n";
+        return false;
+    }
+    if (opts.ioBlockMB < 1 || opts.ioBlockMB > 64) {
+        std::cerr << "--io-block-mb must be between 1 and 64\n";
+        return false;
+    }
+    if (opts.preallocMB < 0) {
+        std::cerr << "--prealloc-mb must not be negative\n";
+        return false;
+    }
+    if (opts.replaySeconds < 0 || opts.replaySeconds > 3600) {
+        std::cerr << "--replay-seconds must be between 0 and 3600\n";
+        return false;
+    }
+    if (opts.replayMB < 16 || opts.replayMB > 16384) {
+        std::cerr << "--replay-mb must be between 16 and 16384\n";
+        return false;
+    }
+    if (!opts.benchmark.empty() && opts.benchmark != "static" && opts.benchmark != "scroll" &&
+        opts.benchmark != "noise") {
+        std::cerr << "--benchmark must be static, scroll or noise\n";
+        return false;
+    }
+    if (opts.benchWidth < 16 || opts.benchHeight < 16 || opts.benchWidth > 8192 || opts.benchHeight > 8192) {
+        std::cerr << "--bench-size must be between 16x16 and 8192x8192\n";
+        return false;
+    }
+    if (opts.benchFps < 0 || opts.benchFps > 1000) {
+        std::cerr << "--bench-fps must be between 0 and 1000\n";
+        return false;
+    }
+    if (opts.benchSeconds < 1 || opts.benchSeconds > 3600) {
+        std::cerr << "--bench-seconds must be between 1 and 3600\n";
+        return false;
+    }
+    return true;
+}
+
+
+// --- Presets and profiles ---
+// A preset is a list of flags applied before everything else. A profile is
+// an INI-style file of "flag = value" lines, with the flags spelled as on
+// the command line without the dashes ("fps = 60", "gpu-convert = true");
+// "preset = name" in a profile picks its base. Later sources override
+// earlier ones: preset, then profile, then the command line.
+struct Preset {
+    const char* name;
+    std::vector<std::string> args;
+};
+
+const std::vector<Preset>& presets() {
+    static const std::vector<Preset> table = {
+        // Work off the CPU wherever the hardware allows it
+        { "low-cpu", { "--gpu-convert", "--hw-encoder", "auto", "--fps", "30", "--bitrate-kbps", "8000", "--adaptive",
+                       "--x264-preset", "ultrafast", "--x264-tune", "fastdecode", "--scaler", "fast-bilinear" } },
+        // Sharper text and fewer artefacts for archiving, at several times the encode cost
+        { "high-quality", { "--fps", "60", "--bitrate-kbps", "25000", "--gop", "240", "--x264-preset", "veryfast",
+                            "--x264-tune", "stillimage", "--x264-thread-type", "frame", "--scaler", "lanczos",
+                            "--container", "mkv" } },
+        // Smallest capture-to-packet delay: short queues, no lookahead, drop stale frames
+        { "low-latency", { "--fps", "60", "--gop", "60", "--x264-preset", "ultrafast", "--x264-tune", "zerolatency",
+                           "--x264-thread-type", "slice", "--rc-lookahead", "0", "--pool-size", "8",
+                           "--staging-ring", "2", "--backpressure", "drop-oldest" } },
+    };
+    return table;
+}
+
+// Flags that take no value; in a profile they are set with a true value
+// and skipped with a false one
+bool isSwitch(const std::string& flag) {
+    static const char* switches[] = { "--gpu-convert", "--dirty-rects", "--no-audio", "--vfr", "--composite",
+                                      "--async-io", "--no-buffering", "--adaptive", "--no-cursor", "--cpu-sets",
+                                      "--mmcss", "--eco-encoder", "--sampled-hash" };
+    return std::find(std::begin(switches), std::end(switches), flag) != std::end(switches);
+}
+
+bool loadProfile(const std::string& path, std::vector<std::string>& args) {
+    FILE* file = std::fopen(path.c_str(), "r");
+    if (!file) {
+        std::cerr << "Cannot open profile " << path << "\n";
+        return false;
+    }
+    auto trim = [](std::string text) {
+        size_t first = text.find_first_not_of(" \t\r\n");
+        size_t last = text.find_last_not_of(" \t\r\n");
+        return first == std::string::npos ? std::string() : text.substr(first, last - first + 1);
+    };
+    char line[1024];
+    int lineNumber = 0;
+    bool ok = true;
+    while (ok && std::fgets(line, sizeof(line), file)) {
+        ++lineNumber;
+        std::string text = trim(line);
+        if (text.empty() || text[0] == '#' || text[0] == ';' || text[0] == '[') continue;
+        size_t equals = text.find('=');
+        if (equals == std::string::npos) {
+            std::cerr << path << ":" << lineNumber << ": expected flag = value\n";
+            ok = false;
+            break;
+        }
+        std::string flag = "--" + trim(text.substr(0, equals));
+        std::string value = trim(text.substr(equals + 1));
+        if (isSwitch(flag)) {
+            if (value == "true" || value == "1" || value == "yes") {
+                args.push_back(flag);
+            } else if (value != "false" && value != "0" && value != "no") {
+                std::cerr << path << ":" << lineNumber << ": " << flag.substr(2) << " must be true or false\n";
+                ok = false;
+            }
+            continue;
+        }
+        args.push_back(flag);
+        args.push_back(value);
+    }
+    std::fclose(file);
+    return ok;
+}
+
+bool parseOptions(int argc, char** argv, RecorderOptions& opts) {
+    std::string presetName, profilePath;
+    std::vector<std::string> commandLine;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--preset" && i + 1 < argc) {
+            presetName = argv[++i];
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else {
+            commandLine.push_back(arg);
+        }
+    }
+
+    std::vector<std::string> profileArgs;
+    if (!profilePath.empty() && !loadProfile(profilePath, profileArgs)) return false;
+    for (size_t i = 0; i + 1 < profileArgs.size(); ++i) {
+        if (profileArgs[i] != "--preset") continue;
+        if (presetName.empty()) presetName = profileArgs[i + 1]; // the command line still wins
+        profileArgs.erase(profileArgs.begin() + i, profileArgs.begin() + i + 2);
+        break;
+    }
+
+    std::vector<std::string> args;
+    if (!presetName.empty()) {
+        auto it = std::find_if(presets().begin(), presets().end(),
+                               [&](const Preset& p) { return presetName == p.name; });
+        if (it == presets().end()) {
+            std::cerr << "--preset must be low-cpu, high-quality or low-latency\n";
+            return false;
+        }
+        args = it->args;
+        std::cout << "Preset: " << presetName << "\n";
+    }
+    args.insert(args.end(), profileArgs.begin(), profileArgs.end());
+    args.insert(args.end(), commandLine.begin(), commandLine.end());
+    return parseArguments(args, opts) && validateOptions(opts);
+}
+
+// --- Software encode ---
+// libx264 as both the recorder and the benchmark run it; nullptr (with a
+// message) if it cannot be opened
+AVCodecContext* openX264(const RecorderOptions& opts, int width, int height, AVPixelFormat pixFmt, int fps,
+                         AVRational timeBase, bool globalHeader, int cores) {
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!codec) { std::cerr << "H.264 codec not found\n"; return nullptr; }
+
+    AVCodecContext* codecCtx = avcodec_alloc_context3(codec);
+    codecCtx->width = width;
+    codecCtx->height = height;
+    codecCtx->pix_fmt = pixFmt;
+    // CRF spends little on a static screen; the VBV cap still bounds bursts
+    codecCtx->bit_rate = opts.crf ? 0 : (int64_t)opts.bitrateKbps * 1000;
+    codecCtx->rc_max_rate = (int64_t)opts.bitrateKbps * 1000;
+    codecCtx->rc_buffer_size = codecCtx->rc_max_rate;
+    codecCtx->gop_size = opts.gop;
+    codecCtx->max_b_frames = 0;
+    codecCtx->time_base = timeBase;
+    codecCtx->framerate = {fps, 1};
+    if (globalHeader) codecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    // Slice threads split each frame and add no latency; frame threads
+    // scale further but hold roughly one frame per thread in flight.
+    // The default leaves a core each for capture and the encoder loop.
+    int threads = opts.x264Threads;
+    if (threads == 0) threads = std::max(1, std::min(16, cores - 2));
+    codecCtx->thread_count = threads;
+    codecCtx->thread_type = opts.x264ThreadType == "frame" ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+    av_opt_set(codecCtx->priv_data, "preset", opts.x264Preset.c_str(), 0);
+    if (!opts.x264Tune.empty()) av_opt_set(codecCtx->priv_data, "tune", opts.x264Tune.c_str(), 0);
+    av_opt_set(codecCtx->priv_data, "profile", "main", 0);
+    // Explicit, so the x264 log matches what was asked for
+    av_opt_set(codecCtx->priv_data, "x264-params",
+               codecCtx->thread_type == FF_THREAD_SLICE ? "sliced-threads=1" : "sliced-threads=0", 0);
+    if (opts.rcLookahead >= 0) av_opt_set_int(codecCtx->priv_data, "rc-lookahead", opts.rcLookahead, 0);
+    if (opts.crf) av_opt_set_double(codecCtx->priv_data, "crf", opts.crf, 0);
+
+    if (avcodec_open2(codecCtx, codec, nullptr) < 0) {
+        std::cerr << "Failed to open codec\n";
+        avcodec_free_context(&codecCtx);
+    }
+    return codecCtx;
+}
+
+// --- Adaptive quality ---
+// Feedback from the encoder thread. When frames queue up or encoding takes
+// most of the frame interval it gives up quality first (CRF up, or bitrate
+// down without --crf), then frame rate by encoding only every Nth capture
+// slot; with headroom again it steps back the same way in reverse.
+// Decisions are made once a second, so one slow frame does not move it.
+// Only libx264 can be reconfigured mid-stream; hardware encoders adapt
+// frame rate only. The output size never changes, as that would need a
+// new encoder and a new stream.
+class AdaptiveController {
+public:
+    AdaptiveController(const RecorderOptions& opts, bool x264, const std::string& tag)
+        : tag(tag), fps(opts.fps), poolSize(opts.poolSize), baseCrf(opts.crf),
+          baseBitRate((int64_t)opts.bitrateKbps * 1000) {
+        if (x264) maxQuality = baseCrf ? (opts.maxCrf - baseCrf) / 2 : 4;
+        maxDivisor = std::max(1, opts.fps / opts.minFps);
+        windowStart = qpcNow();
+    }
+
+    // Encoder thread, after each frame
+    void update(AVCodecContext* ctx, int64_t encodeTicks, uint32_t queueDepth) {
+        windowTicks += encodeTicks;
+        ++windowFrames;
+        peakDepth = std::max(peakDepth, queueDepth);
+        int64_t now = qpcNow();
+        if (now - windowStart < qpcFrequency()) return;
+
+        // Share of the time between encoded frames spent encoding
+        double interval = (double)qpcFrequency() * divisor() / fps;
+        double load = windowTicks / (double)windowFrames / interval;
+        bool behind = peakDepth > (uint32_t)poolSize / 4 || load > 0.9;
+        bool idle = peakDepth <= 1 && load < 0.5;
+        if (behind) {
+            calmWindows = 0;
+            if (quality < maxQuality) setQuality(ctx, quality + 1);
+            else if (divisor() < maxDivisor) setDivisor(divisor() + 1);
+        } else if (idle && ++calmWindows >= 3) {
+            calmWindows = 0;
+            if (divisor() > 1) setDivisor(divisor() - 1);
+            else if (quality > 0) setQuality(ctx, quality - 1);
+        } else if (!idle) {
+            calmWindows = 0;
+        }
+        windowStart = now;
+        windowTicks = 0;
+        windowFrames = 0;
+        peakDepth = 0;
+    }
+
+    // Capture thread: encode every divisor()-th slot
+    int divisor() const { return captureDivisor.load(std::memory_order_relaxed); }
+
+private:
+    // libx264 picks up changed crf and bit_rate on the next frame
+    void setQuality(AVCodecContext* ctx, int level) {
+        quality = level;
+        if (baseCrf) {
+            av_opt_set_double(ctx->priv_data, "crf", baseCrf + 2 * level, 0);
+            std::cout << tag << "[adaptive] crf " << baseCrf + 2 * level << "\n";
+        } else {
+            ctx->bit_rate = baseBitRate * (20 - 3 * level) / 20;
+            ctx->rc_max_rate = ctx->bit_rate;
+            std::cout << tag << "[adaptive] bitrate " << ctx->bit_rate / 1000 << " kbps\n";
+        }
+    }
+
+    void setDivisor(int value) {
+        captureDivisor.store(value, std::memory_order_relaxed);
+        std::cout << tag << "[adaptive] " << fps / (double)value << " fps\n";
+    }
+
+    std::string tag;
+    int fps;
+    int poolSize;
+    int baseCrf;          // 0: bitrate mode
+    int64_t baseBitRate;
+    int quality = 0;      // steps below the configured quality
+    int maxQuality = 0;
+    int maxDivisor = 1;
+    std::atomic<int> captureDivisor{1};
+    int64_t windowStart;
+    int64_t windowTicks = 0;
+    int windowFrames = 0;
+    uint32_t peakDepth = 0;
+    int calmWindows = 0;
+};
+
+// --- Benchmark ---
+// Generated BGRA frames through the recorder's own sws_scale -> FramePool ->
+// FrameQueue -> libx264 path, so settings can be compared without a live
+// desktop. Packets are counted and dropped; nothing is written.
+class LatencySamples {
+public:
+    void add(int64_t ticks) { samples.push_back(ticks); }
+
+    // "p50 p95 p99 max" in ms
+    std::string summary() {
+        if (samples.empty()) return "     -      -      -      -";
+        std::sort(samples.begin(), samples.end());
+        auto at = [&](double q) { return samples[std::min(samples.size() - 1, (size_t)(q * samples.size()))]; };
+        double msPerTick = 1000.0 / qpcFrequency();
+        std::ostringstream oss;
+        oss << std::fixed << std::setprecision(2);
+        for (int64_t v : { at(0.50), at(0.95), at(0.99), samples.back() }) oss << std::setw(7) << v * msPerTick;
+        return oss.str();
+    }
+
+private:
+    std::vector<int64_t> samples;
+};
+
+// Static: a fixed test card. Scroll: a page of text-like bars moving up
+// 8 rows a frame, read straight out of a double-height pattern.
+// Noise: fresh random pixels every frame, the worst case for the encoder.
+class SyntheticScene {
+public:
+    SyntheticScene(const std::string& kind, int width, int height)
+        : kind(kind), width(width), height(height), pattern((size_t)width * 4 * height * 2) {
+        for (int y = 0; y < height * 2; ++y) {
+            uint8_t* row = &pattern[(size_t)y * width * 4];
+            bool textRow = kind == "scroll" && (y % 24) < 14 && (y / 24) % 5 != 4;
+            for (int x = 0; x < width; ++x) {
+                uint8_t* px = row + x * 4;
+                if (textRow) {
+                    uint8_t ink = ((x / 9) % 7 != 6) && ((x * 7 + y * 3) % 11 < 6) ? 20 : 235;
+                    px[0] = px[1] = px[2] = ink;
+                } else {
+                    px[0] = (uint8_t)(x * 255 / width);
+                    px[1] = (uint8_t)(y * 255 / (height * 2));
+                    px[2] = ((x / 64 + y / 64) & 1) ? 200 : 60;
+                }
+                px[3] = 255;
+            }
+        }
+    }
+
+    // Frame n as BGRA rows
+    const uint8_t* frame(int64_t n) {
+        if (kind == "scroll") return &pattern[(size_t)(n * 8 % height) * width * 4];
+        if (kind == "noise") {
+            uint32_t* px = (uint32_t*)pattern.data();
+            for (size_t i = 0, count = (size_t)width * height; i < count; ++i) {
+                rng ^= rng << 13;
+                rng ^= rng >> 17;
+                rng ^= rng << 5;
+                px[i] = rng | 0xff000000u;
+            }
+        }
+        return pattern.data();
+    }
+
+    int stride() const { return width * 4; }
+
+private:
+    std::string kind;
+    int width, height;
+    std::vector<uint8_t> pattern;
+    uint32_t rng = 2463534242u;
+};
+
+int64_t processCpuTicks() {
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    auto ticks = [](const FILETIME& t) { return ((int64_t)t.dwHighDateTime << 32) | t.dwLowDateTime; };
+    return ticks(kernel) + ticks(user); // 100 ns units
+}
+
+bool runBenchmark(const RecorderOptions& opts) {
+    const int width = opts.benchWidth & ~1;
+    const int height = opts.benchHeight & ~1;
+    const int fps = opts.benchFps ? opts.benchFps : 30;
+    const AVRational timeBase = { 1, fps };
+    const int cores = std::max(1, (int)std::thread::hardware_concurrency());
+
+    AVCodecContext* codecCtx = openX264(opts, width, height, AV_PIX_FMT_YUV420P, fps, timeBase, false, cores);
+    if (!codecCtx) return false;
+    SwsContext* swsCtx = sws_getContext(width, height, AV_PIX_FMT_BGRA, width, height, AV_PIX_FMT_YUV420P,
+                                        scalerFlags(opts.scaler), nullptr, nullptr, nullptr);
+    SyntheticScene scene(opts.benchmark, width, height);
+    FrameQueue frameQueue(opts.poolSize + 16, opts.waitStrategy);
+    FramePool framePool(opts.poolSize, width, height, AV_PIX_FMT_YUV420P, opts.waitStrategy, nullptr, opts.poolPages);
+
+    // Frame start times by PTS; far more slots than frames can be in flight
+    std::vector<int64_t> started(1024);
+    std::vector<int64_t> queued(1024);
+    LatencySamples generateTimes, convertTimes, queueTimes, encodeTimes, totalTimes;
+    int64_t packets = 0, bytes = 0;
+
+    std::thread encoderThread([&]() {
+        AVPacket pkt = {};
+        FrameItem item;
+        while (frameQueue.pop(item)) {
+            int64_t t0 = qpcNow();
+            queueTimes.add(t0 - queued[item.pts & 1023]);
+            item.frame->pts = item.pts;
+            int sent = avcodec_send_frame(codecCtx, item.frame);
+            framePool.release(item.frame); // libx264 copies its input
+            if (sent < 0) {
+                std::cerr << "Error sending frame to encoder\n";
+                break;
+            }
+            while (avcodec_receive_packet(codecCtx, &pkt) == 0) {
+                int64_t now = qpcNow();
+                totalTimes.add(now - started[pkt.pts & 1023]);
+                ++packets;
+                bytes += pkt.size;
+                av_packet_unref(&pkt);
+            }
+            encodeTimes.add(qpcNow() - t0);
+        }
+        avcodec_send_frame(codecCtx, nullptr);
+        while (avcodec_receive_packet(codecCtx, &pkt) == 0) {
+            totalTimes.add(qpcNow() - started[pkt.pts & 1023]);
+            ++packets;
+            bytes += pkt.size;
+            av_packet_unref(&pkt);
+        }
+    });
+
+    std::cout << "Benchmark: " << opts.benchmark << " " << width << "x" << height << ", "
+              << codecCtx->codec->name << " (" << codecCtx->thread_count << " " << opts.x264ThreadType
+              << " threads), " << (opts.benchFps ? std::to_string(opts.benchFps) + " fps" : std::string("unpaced"))
+              << ", " << opts.benchSeconds << " s\n";
+
+    // Paced runs drop a frame when the pool is empty, as the recorder does;
+    // unpaced runs wait for one, so frames/s is what the encoder sustains
+    PacingTimer pacingTimer;
+    const int64_t begin = qpcNow();
+    const int64_t end = begin + opts.benchSeconds * qpcFrequency();
+    const int64_t cpuBegin = processCpuTicks();
+    int64_t frames = 0, dropped = 0;
+    while (!stopRecording && qpcNow() < end) {
+        if (opts.benchFps) {
+            int64_t due = begin + frames * qpcFrequency() / opts.benchFps;
+            if (qpcNow() < due) pacingTimer.waitUntil(due);
+        }
+        int64_t pts = frames++;
+        int64_t t0 = qpcNow();
+        started[pts & 1023] = t0;
+        const uint8_t* bgra = scene.frame(pts);
+        int64_t t1 = qpcNow();
+        generateTimes.add(t1 - t0);
+
+        AVFrame* frame = framePool.acquire(opts.benchFps ? 0 : 1000);
+        if (!frame) {
+            ++dropped;
+            continue;
+        }
+        av_frame_make_writable(frame);
+        const uint8_t* srcData[1] = { bgra };
+        int srcLinesize[1] = { scene.stride() };
+        sws_scale(swsCtx, srcData, srcLinesize, 0, height, frame->data, frame->linesize);
+        int64_t t2 = qpcNow();
+        convertTimes.add(t2 - t1);
+
+        queued[pts & 1023] = t2;
+        if (!frameQueue.push({ frame, pts })) {
+            framePool.putBack(frame);
+            ++dropped;
+        }
+    }
+    frameQueue.close();
+    encoderThread.join();
+    const double seconds = (double)(qpcNow() - begin) / qpcFrequency();
+    const double cpuMs = (processCpuTicks() - cpuBegin) / 10000.0;
+
+    PROCESS_MEMORY_COUNTERS memory = {};
+    memory.cb = sizeof(memory);
+    GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory));
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1);
+    oss << "  " << packets << " frames in " << seconds << " s = " << packets / seconds << " fps, "
+        << dropped << " dropped, " << bytes / 1048576.0 << " MB encoded\n";
+    oss << "  stage        p50    p95    p99    max (ms)\n";
+    oss << "  generate " << generateTimes.summary() << "\n";
+    oss << "  convert  " << convertTimes.summary() << "\n";
+    oss << "  queue    " << queueTimes.summary() << "\n";
+    oss << "  encode   " << encodeTimes.summary() << "\n";
+    oss << "  total    " << totalTimes.summary() << "\n";
+    oss << std::setprecision(2) << "  CPU " << (packets ? cpuMs / packets : 0.0) << " ms/frame ("
+        << std::setprecision(1) << cpuMs / (seconds * 10.0 * cores) << "% of " << cores << " cores), peak RSS "
+        << memory.PeakWorkingSetSize / 1048576.0 << " MB\n";
+    std::cout << oss.str();
+
+    sws_freeContext(swsCtx);
+    avcodec_free_context(&codecCtx);
+    return packets > 0;
+}
+
+// --- Capture pipeline ---
+// Everything from duplication to file for one output, or for one composite
+// of outputs: its own device, staging ring, pool, encoder thread and files.
+// One pipeline runs per selected output.
+struct PipelineConfig {
+    std::vector<DisplayOutput> outputs; // more than one: composite them
+    std::string label;                  // "mon0", ... in logs and file names; empty when alone
+    std::string baseName;               // output file name without extension
+    DWORD_PTR affinity = 0;             // cores for the capture and encoder threads, 0 = any
+    int cores = 1;                      // cores this pipeline can count on
+    bool audio = false;                 // loopback audio goes into this pipeline's file
+    const std::atomic<int>* replaySaves = nullptr; // bumped once per replay save request
+    TelemetryCounters* telemetry = nullptr;
+};
+
+bool runPipeline(const RecorderOptions& opts, const PipelineConfig& config) {
+    ScopedThreadPolicy policy(ThreadRole::Capture, config.affinity);
+    const std::string tag = config.label.empty() ? "" : "[" + config.label + "] ";
+
+    const int targetFPS = opts.fps;
+    // CFR counts in frames; VFR stamps in 90 kHz ticks (not possible in AVI)
+    const AVRational encoderTimeBase = opts.vfr ? AVRational{ 1, 90000 } : AVRational{ 1, targetFPS };
+
+    MuxerConfig muxerConfig;
+    muxerConfig.format = opts.container == "mkv" ? "matroska" : opts.container;
+    muxerConfig.baseName = config.baseName;
+    muxerConfig.extension = opts.container;
+    muxerConfig.flushMs = opts.flushMs;
+    muxerConfig.segmentSeconds = opts.segmentMinutes * 60;
+    muxerConfig.segmentBytes = (int64_t)opts.segmentMB * 1024 * 1024;
+    muxerConfig.asyncIo = opts.asyncIo;
+    muxerConfig.ioOptions.blockBytes = (size_t)opts.ioBlockMB << 20;
+    muxerConfig.ioOptions.noBuffering = opts.noBuffering;
+    muxerConfig.ioOptions.preallocBytes = (int64_t)opts.preallocMB << 20;
+
+    // --- 1. D3D11 device ---
+    ComPtr<ID3D11Device> device;
+    ComPtr<ID3D11DeviceContext> context;
+    D3D_FEATURE_LEVEL featureLevel;
+    bool wantScale = opts.outputWidth || opts.outputScale != 0;
+    bool wantGpuConvert = opts.gpuConvert || !opts.hwEncoder.empty();
+    UINT deviceFlags = wantGpuConvert || wantScale ? D3D11_CREATE_DEVICE_VIDEO_SUPPORT : 0;
+    // Duplication only works on the adapter the output is attached to
+    IDXGIAdapter* adapter = config.outputs[0].adapter.Get();
+    HRESULT hr = D3D11CreateDevice(adapter, D3D_DRIVER_TYPE_UNKNOWN, nullptr, deviceFlags,
+                                   nullptr, 0, D3D11_SDK_VERSION,
+                                   &device, &featureLevel, &context);
+    if (FAILED(hr) && deviceFlags) {
+        hr = D3D11CreateDevice(adapter, D3D_DRIVER_TYPE_UNKNOWN, nullptr, 0,
+                               nullptr, 0, D3D11_SDK_VERSION,
+                               &device, &featureLevel, &context);
+    }
+    if (FAILED(hr)) {
+        std::cerr << tag << "Failed to create D3D11 device\n";
+        return false;
+    }
+
+    // --- 2. DXGI duplication ---
+    DesktopSource desktop;
+    if (!desktop.init(device.Get(), context.Get(), config.outputs)) return false;
+
+    // Capture at whatever mode the output runs in; encode at the requested
+    // size, rounded down to even for 4:2:0 chroma
+    int captureWidth = desktop.width();
+    int captureHeight = desktop.height();
+    int width = captureWidth;
+    int height = captureHeight;
+    if (opts.outputWidth) {
+        width = opts.outputWidth;
+        height = opts.outputHeight;
+    } else if (opts.outputScale != 0) {
+        width = (int)(captureWidth * opts.outputScale + 0.5);
+        height = (int)(captureHeight * opts.outputScale + 0.5);
+    }
+    width &= ~1;
+    height &= ~1;
+    bool scaled = width != (captureWidth & ~1) || height != (captureHeight & ~1);
+    std::cout << tag << "Capture " << captureWidth << "x" << captureHeight
+              << ", output " << width << "x" << height << "\n";
+
+    // --- 2b. Optional GPU colour conversion and scaling ---
+    GpuConverter gpuConverter;
+    bool useGpuConvert = false; // desktop -> NV12 at output size on the GPU
+    bool useGpuScale = false;   // desktop -> BGRA at output size on the GPU, then sws_scale
+    if (wantGpuConvert) {
+        useGpuConvert = gpuConverter.init(device.Get(), context.Get(), captureWidth, captureHeight, width, height,
+                                          DXGI_FORMAT_NV12, opts.cursor);
+        if (!useGpuConvert) std::cerr << "GPU conversion unavailable, using sws_scale\n";
+    }
+    if (!useGpuConvert && scaled) {
+        useGpuScale = gpuConverter.init(device.Get(), context.Get(), captureWidth, captureHeight,
+                                        width, height, DXGI_FORMAT_B8G8R8A8_UNORM);
+        if (!useGpuScale) std::cerr << "GPU scaling unavailable, scaling with sws_scale\n";
+    }
+    // Size of what lands in the staging ring and gets read back
+    int readbackWidth = useGpuConvert || useGpuScale ? width : captureWidth;
+    int readbackHeight = useGpuConvert || useGpuScale ? height : captureHeight;
+
+    // --- 3. FFmpeg init ---
+    OutputMuxer muxer(muxerConfig);
+
+    // Matroska and MP4 want SPS/PPS in the stream header, not in-band only
+    const bool globalHeader = muxer.needsGlobalHeader();
+
+    // Zero-copy hardware encoder first, libx264 as the fallback. The
+    // texture pool has --pool-size slices, like the CPU frame pool; frames
+    // the encoder keeps in flight come out of the same budget.
+    AVBufferRef* hwDeviceCtx = nullptr;
+    AVBufferRef* hwFramesCtx = nullptr;
+    AVCodecContext* codecCtx = nullptr;
+    if (!opts.hwEncoder.empty() && useGpuConvert &&
+        createHwFrames(device.Get(), width, height, opts.poolSize, &hwDeviceCtx, &hwFramesCtx)) {
+        std::vector<const char*> candidates;
+        if (opts.hwEncoder == "nvenc" || opts.hwEncoder == "auto") candidates.push_back("h264_nvenc");
+        if (opts.hwEncoder == "amf" || opts.hwEncoder == "auto") candidates.push_back("h264_amf");
+        if (opts.hwEncoder == "qsv" || opts.hwEncoder == "auto") candidates.push_back("h264_qsv");
+        for (const char* name : candidates) {
+            codecCtx = openHwEncoder(name, hwFramesCtx, width, height, targetFPS, encoderTimeBase, globalHeader,
+                                     (int64_t)opts.bitrateKbps * 1000, opts.gop);
+            if (codecCtx) break;
+        }
+    }
+    bool hwEncode = codecCtx != nullptr;
+    if (!hwEncode && !opts.hwEncoder.empty()) {
+        std::cerr << "Hardware encoder unavailable, using libx264\n";
+        av_buffer_unref(&hwFramesCtx);
+        av_buffer_unref(&hwDeviceCtx);
+    }
+
+    if (!hwEncode) {
+        codecCtx = openX264(opts, width, height, useGpuConvert ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P,
+                            targetFPS, encoderTimeBase, globalHeader, config.cores);
+        if (!codecCtx) return false;
+    }
+    std::cout << tag << "Encoder: " << codecCtx->codec->name;
+    if (!hwEncode) std::cout << " (" << codecCtx->thread_count << " " << opts.x264ThreadType << " threads)";
+    std::cout << "\n";
+
+    const int videoStream = muxer.addStream(codecCtx, true); // segments start on video keyframes
+
+    // Loopback audio goes into the same container; without it the
+    // recording carries on video-only
+    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    std::unique_ptr<AudioCapture> audioCapture;
+    int audioStream = -1;
+    if (opts.audio && config.audio) {
+        audioCapture.reset(new AudioCapture());
+        if (audioCapture->init(globalHeader, opts.audioCodec)) {
+            AVCodecContext* audioCtx = audioCapture->codecContext();
+            audioStream = muxer.addStream(audioCtx, false);
+            std::cout << tag << "Audio: " << audioCtx->codec->name << ", " << audioCapture->sampleRate()
+                      << " Hz, " << audioCapture->channels() << " channels\n";
+        } else {
+            std::cerr << "Loopback audio unavailable, recording video only\n";
+            audioCapture.reset();
+        }
+    }
+
+    // Replay mode keeps packets in memory; files are only written on demand
+    std::unique_ptr<ReplayBuffer> replay;
+    if (opts.replaySeconds) {
+        replay.reset(new ReplayBuffer((size_t)opts.replayMB << 20, opts.replaySeconds, videoStream));
+    } else if (!muxer.start()) {
+        return false;
+    }
+    PacketSink* sink = replay ? static_cast<PacketSink*>(replay.get()) : &muxer;
+
+    // --- 4. SwsContext (CPU conversion only) ---
+    SwsContext* swsCtx = nullptr;
+    if (!useGpuConvert) {
+        // An odd desktop size loses its last row/column here
+        swsCtx = sws_getContext(
+            readbackWidth & ~1, readbackHeight & ~1, AV_PIX_FMT_BGRA,
+            width, height, AV_PIX_FMT_YUV420P,
+            scalerFlags(opts.scaler), nullptr, nullptr, nullptr
+        );
+    }
+
+    FrameQueue frameQueue(opts.poolSize + 16, opts.waitStrategy); // room for every pool frame and repeat markers
+
+    // --- CPU staging ring ---
+    D3D11_TEXTURE2D_DESC cpuDesc = {};
+    cpuDesc.Width = readbackWidth;
+    cpuDesc.Height = readbackHeight;
+    cpuDesc.MipLevels = 1;
+    cpuDesc.ArraySize = 1;
+    cpuDesc.Format = useGpuConvert ? DXGI_FORMAT_NV12 : DXGI_FORMAT_B8G8R8A8_UNORM;
+    cpuDesc.SampleDesc.Count = 1;
+    cpuDesc.Usage = D3D11_USAGE_STAGING;
+    cpuDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    cpuDesc.BindFlags = 0;
+    cpuDesc.MiscFlags = 0;
+    StagingRing stagingRing;
+    if (!stagingRing.init(device.Get(), cpuDesc, opts.stagingRingSize, opts.waitStrategy)) {
+        std::cerr << "Failed to create staging textures\n"; return false;
+    }
+
+    // --- Frame pool ---
+    FramePool framePool(opts.poolSize, width, height, codecCtx->pix_fmt, opts.waitStrategy, hwFramesCtx, opts.poolPages);
+    if (framePool.memoryBytes()) {
+        std::cout << tag << "Frame pool: " << opts.poolSize << " frames, " << (framePool.memoryBytes() >> 20)
+                  << " MB on " << framePool.memoryBacking() << "\n";
+    }
+
+    // --- Incremental conversion (sws_scale path only) ---
+    // Dirty rects are in desktop coordinates, so any scaling rules it out
+    bool dirtyMode = opts.dirtyRects && !useGpuConvert && !scaled && desktop.duplication();
+    if (opts.dirtyRects && !dirtyMode) std::cerr << "--dirty-rects only applies to the unscaled sws_scale path of one output, ignoring\n";
+    DirtyTracker dirtyTracker;
+    std::unique_ptr<TileConverter> tileConverter;
+    AVFrame* sceneFrame = nullptr; // persistent YUV copy of the desktop (dirty-rect mode)
+    bool sceneReady = false;
+    std::vector<BYTE> metadataBuffer;
+    std::vector<RECT> frameRects;
+
+    // --- Sliced, overlapped conversion (unscaled sws_scale path) ---
+    const int convertThreads = opts.convertThreads ? opts.convertThreads : std::max(1, std::min(4, config.cores / 4));
+    std::unique_ptr<SliceConverter> sliceConverter;
+    auto makeSliceConverter = [&]() {
+        sliceConverter.reset();
+        if (useGpuConvert || dirtyMode || (readbackWidth & ~1) != width || (readbackHeight & ~1) != height) return;
+        sliceConverter.reset(new SliceConverter());
+        if (!sliceConverter->init(width, height, convertThreads, scalerFlags(opts.scaler), config.affinity)) {
+            std::cerr << tag << "Sliced conversion unavailable, using a single sws_scale\n";
+            sliceConverter.reset();
+        }
+    };
+    makeSliceConverter();
+    if (sliceConverter) std::cout << tag << "Converting in " << sliceConverter->slices() << " slices\n";
+
+    // The pointer: drawn on the GPU before conversion on the zero-copy path,
+    // blended into each outgoing frame otherwise, with the clean scene kept
+    // so a pointer-only update needs no readback
+    const bool cursorGpu = opts.cursor && hwEncode;
+    const bool cursorCpu = opts.cursor && !hwEncode;
+    double cursorScaleX = (double)width / captureWidth;
+    double cursorScaleY = (double)height / captureHeight;
+    CursorBlender cursorBlender;
+    if (dirtyMode) {
+        dirtyTracker.init(stagingRing.size(), width, height);
+        tileConverter.reset(new TileConverter(width, height, scalerFlags(opts.scaler)));
+    }
+    if (dirtyMode) {
+        sceneFrame = av_frame_alloc();
+        sceneFrame->format = codecCtx->pix_fmt;
+        sceneFrame->width = width;
+        sceneFrame->height = height;
+        av_frame_get_buffer(sceneFrame, 32);
+    }
+
+    // --- 5. Encoder thread ---
+    DropStats dropStats;
+    std::atomic<uint32_t> discardRequests{0}; // drop-oldest: queued frames to skip
+
+    // Repeats of the last frame stand in for dropped captures
+    // (Backpressure::Duplicate), for unchanged ones (--static-frames repeat)
+    // and, at a constant frame rate, for the slots of a duplication outage
+    const bool retainLast = opts.backpressure == Backpressure::Duplicate || opts.staticFrames == "repeat" || !opts.vfr;
+
+    TelemetryCounters& telemetry = *config.telemetry;
+    telemetry.bitrateTarget.store(codecCtx->rc_max_rate, std::memory_order_relaxed);
+    std::unique_ptr<AdaptiveController> adaptive;
+    if (opts.adaptive) adaptive.reset(new AdaptiveController(opts, !hwEncode, tag));
+
+    std::thread encoderThread([&]() {
+        ScopedThreadPolicy policy(ThreadRole::Encoder, config.affinity);
+        AVPacket pkt = {};
+        FrameItem item;
+        AVFrame* lastFrame = nullptr; // held back for repeat markers
+        int64_t windowStart = qpcNow();
+        int64_t windowBytes = 0;
+        auto deliver = [&](AVPacket* p) {
+            telemetry.bytes.fetch_add(p->size, std::memory_order_relaxed);
+            windowBytes += p->size;
+            sink->write(p, videoStream, codecCtx->time_base);
+        };
+        while (frameQueue.pop(item)) {
+            AVFrame* frame = item.frame;
+            if (!frame) {
+                // Repeat marker: the capture side had no frame to fill
+                if (!lastFrame) continue;
+                frame = lastFrame;
+            } else if (discardRequests.load(std::memory_order_relaxed) > 0) {
+                discardRequests.fetch_sub(1, std::memory_order_relaxed);
+                dropStats.droppedOldest++;
+                framePool.release(frame);
+                continue;
+            }
+            frame->pts = item.pts;
+
+            int64_t t0 = qpcNow();
+            if (avcodec_send_frame(codecCtx, frame) < 0) {
+                std::cerr << "Error sending frame to encoder\n";
+                if (item.frame) framePool.release(item.frame);
+                break;
+            }
+
+            while (avcodec_receive_packet(codecCtx, &pkt) == 0) {
+                deliver(&pkt);
+                av_packet_unref(&pkt);
+            }
+            int64_t now = qpcNow();
+            if (adaptive) adaptive->update(codecCtx, now - t0, frameQueue.size());
+            int64_t encodeUs = (now - t0) * 1000000 / qpcFrequency();
+            telemetry.encoded.fetch_add(1, std::memory_order_relaxed);
+            telemetry.encodeUsLast.store(encodeUs, std::memory_order_relaxed);
+            telemetry.encodeUsTotal.fetch_add(encodeUs, std::memory_order_relaxed);
+            if (now - windowStart >= qpcFrequency()) {
+                telemetry.bitrate.store(windowBytes * 8 * qpcFrequency() / (now - windowStart), std::memory_order_relaxed);
+                windowStart = now;
+                windowBytes = 0;
+            }
+
+            if (!item.frame) continue;
+            if (retainLast) {
+                if (lastFrame) framePool.release(lastFrame);
+                lastFrame = item.frame;
+            } else {
+                framePool.release(item.frame);
+            }
+        }
+        if (lastFrame) framePool.release(lastFrame);
+
+        // Flush encoder (hardware encoders keep several frames in flight)
+        avcodec_send_frame(codecCtx, nullptr);
+        while (avcodec_receive_packet(codecCtx, &pkt) == 0) {
+            deliver(&pkt);
+            av_packet_unref(&pkt);
+        }
+    });
+
+    // Video PTS and audio samples both count from this QPC tick
+    const int64_t captureEpoch = qpcNow();
+    if (audioCapture && !audioCapture->start(sink, audioStream, captureEpoch)) {
+        std::cerr << "Failed to start audio capture\n";
+        frameQueue.close();
+        encoderThread.join();
+        return false;
+    }
+
+    // Saving the replay buffer: a snapshot is taken here and written on its
+    // own thread, so capture and encoding carry on meanwhile
+    std::vector<std::thread> replayDumps;
+    int replaySavesSeen = config.replaySaves ? config.replaySaves->load() : 0;
+    auto saveReplay = [&]() {
+        std::vector<ReplayBuffer::Packet> packets = replay->snapshot();
+        if (packets.empty()) {
+            std::cerr << tag << "Replay buffer is still empty\n";
+            return;
+        }
+        MuxerConfig dumpConfig = muxerConfig;
+        // Numbered, as two saves can fall into the same second
+        dumpConfig.baseName = getTimestampedBaseName() + (config.label.empty() ? "" : "_" + config.label) +
+                              "_replay" + std::to_string(replayDumps.size() + 1);
+        dumpConfig.segmentSeconds = 0;
+        dumpConfig.segmentBytes = 0;
+        std::shared_ptr<OutputMuxer> dump(new OutputMuxer(dumpConfig));
+        dump->addStream(codecCtx, true);
+        if (audioCapture) dump->addStream(audioCapture->codecContext(), false);
+        double seconds = replay->seconds();
+        replayDumps.emplace_back([dump, packets, seconds, tag]() {
+            // The buffer starts on a video keyframe; audio from before it is dropped
+            const AVRational microseconds = { 1, AV_TIME_BASE };
+            int64_t startUs = av_rescale_q(packets[0].pkt->pts, packets[0].timeBase, microseconds);
+            bool ok = dump->start(startUs);
+            for (const ReplayBuffer::Packet& p : packets) {
+                if (ok && av_rescale_q(p.pkt->pts, p.timeBase, microseconds) >= startUs) {
+                    dump->write(p.pkt, p.streamIndex, p.timeBase);
+                }
+                AVPacket* pkt = p.pkt;
+                av_packet_free(&pkt);
+            }
+            dump->finish();
+            if (ok) std::cout << tag << "Saved replay: " << dump->firstFile() << " (" << (int)seconds << " s)\n";
+        });
+    };
+    // --- 6. Capture loop ---
+    // Capture slots are scheduled on QPC as pacingStart + n / fps, so the
+    // schedule never accumulates rounding (1000 / 30 ms ran 1% fast)
+    PacingTimer pacingTimer;
+    const int64_t pacingStart = qpcNow();
+    int64_t pacingSlot = 0;
+    auto slotTime = [&](int64_t slot) { return pacingStart + slot * qpcFrequency() / targetFPS; };
+
+    // PTS come from the QPC time DXGI presented the frame at (or the time
+    // it was acquired for pointer-only updates), so skipped or dropped
+    // frames leave a gap in the timeline instead of shortening it
+    int64_t lastPts = -1;
+    auto presentPts = [&](int64_t qpc) -> int64_t {
+        int64_t pts = (qpc - captureEpoch) * encoderTimeBase.den / (qpcFrequency() * encoderTimeBase.num);
+        pts = std::max(pts, lastPts + 1);
+        lastPts = pts;
+        return pts;
+    };
+
+    StageTimers stageTimers(10, config.label);
+
+    // A frame to fill for this capture, or nullptr when the backpressure
+    // policy drops it or has already queued a repeat in its place
+    auto acquireFrame = [&](int64_t pts) -> AVFrame* {
+        AVFrame* frame = framePool.acquire();
+        if (frame) return frame;
+        dropStats.poolEmpty++;
+        switch (opts.backpressure) {
+        case Backpressure::DropNewest:
+            break;
+        case Backpressure::DropOldest:
+            // Only the encoder may pop the queue; ask it to skip the oldest
+            // queued frame and wait about one frame for it to come back
+            if (discardRequests.load(std::memory_order_relaxed) < frameQueue.size()) {
+                discardRequests.fetch_add(1, std::memory_order_relaxed);
+            }
+            frame = framePool.acquire(1000 / targetFPS);
+            break;
+        case Backpressure::Duplicate:
+            if (frameQueue.push({ nullptr, pts })) {
+                dropStats.duplicated++;
+                return nullptr;
+            }
+            break;
+        case Backpressure::Block:
+            frame = framePool.acquire(opts.blockTimeoutMs);
+            if (!frame) dropStats.blockTimeouts++;
+            break;
+        }
+        if (!frame) dropStats.droppedNewest++;
+        return frame;
+    };
+
+    // A capture that shows nothing new: repeat the last frame under its own
+    // PTS, or leave a gap, instead of converting and encoding it again.
+    // Nothing is skipped until a real frame has reached the encoder.
+    const bool detectStatic = opts.staticFrames != "encode";
+    bool haveFrame = false;
+    bool lastHashValid = false;
+    uint64_t lastHash = 0;
+    auto sendUnchanged = [&](int64_t pts) {
+        dropStats.unchanged++;
+        if (opts.staticFrames == "repeat") frameQueue.push({ nullptr, pts });
+    };
+
+    // The capture thread publishes the pointer after every acquire; the
+    // convert stage blends its own copy, refreshed when the version moves
+    std::mutex pointerMutex;
+    PointerState pointerShared;
+    PointerState pointerCopy;
+    uint64_t blendedPointer = 0; // pointer version in the last scene sent
+    auto refreshPointer = [&]() -> bool {
+        std::lock_guard<std::mutex> lock(pointerMutex);
+        if (pointerShared.version != pointerCopy.version) pointerCopy = pointerShared;
+        return pointerCopy.version != blendedPointer;
+    };
+
+    // Without dirty rects, the clean scene is the last frame sent with the
+    // pixels under its pointer put back: pool frames keep their contents
+    // until this stage acquires them again, so only a pointer-only update
+    // pays for a full copy, not every converted frame
+    AVFrame* lastScene = nullptr; // pool frame last sent, pointer drawn over scenePatch
+    PointerPatch scenePatch;
+    auto drawPointer = [&](AVFrame* frame) {
+        refreshPointer();
+        int x, y, w, h;
+        if (cursorBlender.bounds(frame, pointerCopy, cursorScaleX, cursorScaleY, x, y, w, h)) {
+            scenePatch.save(frame, x, y, w, h);
+        } else {
+            scenePatch.clear();
+        }
+        cursorBlender.blend(frame, pointerCopy, cursorScaleX, cursorScaleY);
+        blendedPointer = pointerCopy.version;
+        lastScene = frame;
+    };
+
+    // Hand the encoder a copy of the scene, with the pointer in its new place
+    auto enqueueScene = [&](int64_t pts) {
+        int64_t t0 = qpcNow();
+        AVFrame* frameYUV = acquireFrame(pts);
+        if (!frameYUV) return;
+        av_frame_make_writable(frameYUV);
+        if (dirtyMode) {
+            av_frame_copy(frameYUV, sceneFrame);
+        } else {
+            if (frameYUV != lastScene) av_frame_copy(frameYUV, lastScene);
+            scenePatch.restore(frameYUV);
+        }
+        if (cursorCpu) drawPointer(frameYUV);
+        frameYUV->pts = pts;
+        if (frameQueue.push({ frameYUV, pts })) haveFrame = true;
+        else framePool.putBack(frameYUV);
+        stageTimers.add(STAGE_ENQUEUE, qpcNow() - t0);
+    };
+
+    // Convert stage: the only writer of the dirty tracker's state is the
+    // capture thread, which resets it once the stage has drained
+    std::atomic<bool> dirtyReset{false};
+
+    // Map a staged frame, convert it and hand it to the encoder. The GPU
+    // copy is polled for rather than waited on inside Map(), which would
+    // hold the context lock against the capture thread meanwhile. After a
+    // few quick polls the stage sleeps between them instead of spinning a
+    // core for the length of the copy; STAGE_MAP is that wait.
+    PacingTimer mapTimer; // used only on the convert thread
+    auto readbackStaged = [&](int slot, int64_t pts) {
+        ID3D11Texture2D* staged = stagingRing.slot(slot);
+        D3D11_MAPPED_SUBRESOURCE mapped = {};
+        int64_t t0 = qpcNow();
+        HRESULT hr;
+        int polls = 0;
+        while ((hr = context->Map(staged, 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped)) ==
+               DXGI_ERROR_WAS_STILL_DRAWING) {
+            if (++polls <= 4) std::this_thread::yield();
+            else mapTimer.sleep(qpcFrequency() / 4000); // 250 us
+        }
+        stageTimers.add(STAGE_MAP, qpcNow() - t0);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to map staging texture\n";
+            if (dirtyMode) dirtyReset = true;
+            lastHashValid = false;
+            return;
+        }
+
+        // An application presenting the same pixels again
+        if (detectStatic) {
+            t0 = qpcNow();
+            // NV12: the chroma plane follows the luma rows at the same pitch
+            int rowBytes = readbackWidth * (useGpuConvert ? 1 : 4);
+            int rows = useGpuConvert ? readbackHeight * 3 / 2 : readbackHeight;
+            uint64_t hash = hashSurface((const uint8_t*)mapped.pData, (int)mapped.RowPitch, rowBytes, rows,
+                                        opts.sampledHash ? 4 : 1);
+            bool same = lastHashValid && hash == lastHash && haveFrame;
+            lastHash = hash;
+            lastHashValid = true;
+            stageTimers.add(STAGE_CONVERT, qpcNow() - t0);
+            if (same) {
+                context->Unmap(staged, 0);
+                if (cursorCpu && sceneReady && refreshPointer()) enqueueScene(pts);
+                else sendUnchanged(pts);
+                return;
+            }
+        }
+
+        // The persistent frame is updated even when the pool is empty so it
+        // never falls out of step with the staging ring
+        if (dirtyMode) {
+            t0 = qpcNow();
+            bool converted = tileConverter->convert((const uint8_t*)mapped.pData, (int)mapped.RowPitch,
+                                                    sceneFrame, dirtyTracker.changedRects(slot));
+            context->Unmap(staged, 0);
+            stageTimers.add(STAGE_CONVERT, qpcNow() - t0);
+            if (!converted) {
+                std::cerr << "sws_scale failed\n";
+                dirtyReset = true;
+                return;
+            }
+            sceneReady = true;
+            enqueueScene(pts);
+            return;
+        }
+
+        AVFrame* frameYUV = acquireFrame(pts);
+        if (!frameYUV) {
+            context->Unmap(staged, 0);
+            return;
+        }
+        av_frame_make_writable(frameYUV);
+
+        t0 = qpcNow();
+        bool converted = true;
+        if (useGpuConvert) {
+            copyMappedNV12(mapped, frameYUV, width, height);
+        } else if (sliceConverter) {
+            sliceConverter->start((const uint8_t*)mapped.pData, (int)mapped.RowPitch, frameYUV);
+            converted = sliceConverter->finish();
+        } else {
+            uint8_t* srcData[1] = { (uint8_t*)mapped.pData };
+            int srcLinesize[1] = { (int)mapped.RowPitch };
+            converted = sws_scale(swsCtx, srcData, srcLinesize, 0, readbackHeight & ~1, frameYUV->data, frameYUV->linesize) > 0;
+        }
+        context->Unmap(staged, 0);
+        stageTimers.add(STAGE_CONVERT, qpcNow() - t0);
+        if (!converted) {
+            std::cerr << "sws_scale failed\n";
+            if (frameYUV == lastScene) sceneReady = false;
+            framePool.putBack(frameYUV);
+            return;
+        }
+
+        t0 = qpcNow();
+        if (cursorCpu) {
+            drawPointer(frameYUV);
+            sceneReady = true;
+        }
+        frameYUV->pts = pts;
+        if (frameQueue.push({ frameYUV, pts })) haveFrame = true;
+        else framePool.putBack(frameYUV);
+        stageTimers.add(STAGE_ENQUEUE, qpcNow() - t0);
+    };
+
+    // --- 6b. Convert stage (CPU path) ---
+    // The capture thread only acquires, copies the desktop into a free
+    // staging slot and releases the duplication frame; this thread maps,
+    // converts and queues for the encoder. The stages are joined by bounded
+    // rings, so the slowest one sets the pace instead of the sum of all.
+    // The hardware path converts on the GPU and has no such stage.
+    SpscRing<StageItem> stageQueue(opts.stagingRingSize + 16, opts.waitStrategy);
+    std::atomic<int64_t> stageDone{0};
+    int64_t stagePosted = 0;
+    auto runStageItem = [&](const StageItem& item) {
+        switch (item.kind) {
+        case StageItem::STAGED:
+            readbackStaged(item.slot, item.pts);
+            stagingRing.release(item.slot);
+            break;
+        case StageItem::SCENE:
+            if (sceneReady) enqueueScene(item.pts);
+            break;
+        case StageItem::UNCHANGED:
+            sendUnchanged(item.pts);
+            break;
+        case StageItem::HOLD:
+            frameQueue.push({ nullptr, item.pts });
+            break;
+        }
+    };
+    std::thread convertThread;
+    if (!hwEncode) {
+        enableMultithreadProtection(device.Get()); // Map/Unmap from this thread
+        convertThread = std::thread([&]() {
+            ScopedThreadPolicy policy(ThreadRole::Capture, config.affinity);
+            StageItem item;
+            while (stageQueue.pop(item)) {
+                runStageItem(item);
+                stageDone.fetch_add(1, std::memory_order_release);
+            }
+        });
+    }
+    // Capture thread: hand an item to the convert stage, or run it here
+    // when there is none
+    auto post = [&](const StageItem& item) {
+        if (!convertThread.joinable()) {
+            runStageItem(item);
+            return;
+        }
+        while (!stageQueue.push(item)) std::this_thread::yield();
+        ++stagePosted;
+    };
+    // Capture thread: waits until the convert stage has caught up, after
+    // which its state may be touched from here
+    auto drainStage = [&]() {
+        while (stageDone.load(std::memory_order_acquire) != stagePosted) std::this_thread::yield();
+    };
+
+    // Capture thread's view of what has been posted, for its shortcuts
+    bool postedFrame = false;       // a frame is on its way to the encoder
+    uint64_t shownPointer = 0;      // pointer version as of the last frame posted
+    uint64_t publishedPointer = 0;  // pointer version handed to the convert stage
+
+    // After a mode change the encoder keeps its size; whatever depends on
+    // the capture size is rebuilt to scale the new desktop onto it. The
+    // convert stage must be drained.
+    auto resizeCapture = [&]() -> bool {
+        captureWidth = desktop.width();
+        captureHeight = desktop.height();
+        cursorScaleX = (double)width / captureWidth;
+        cursorScaleY = (double)height / captureHeight;
+        std::cout << tag << "Capture now " << captureWidth << "x" << captureHeight
+                  << ", output stays " << width << "x" << height << "\n";
+        if (useGpuConvert || useGpuScale) {
+            // Same output, so the staging ring and frames are unaffected
+            if (!gpuConverter.init(device.Get(), context.Get(), captureWidth, captureHeight, width, height,
+                                   useGpuConvert ? DXGI_FORMAT_NV12 : DXGI_FORMAT_B8G8R8A8_UNORM,
+                                   useGpuConvert && opts.cursor)) {
+                std::cerr << tag << "GPU conversion failed for the new desktop size\n";
+                return false;
+            }
+            return true;
+        }
+        readbackWidth = captureWidth;
+        readbackHeight = captureHeight;
+        cpuDesc.Width = readbackWidth;
+        cpuDesc.Height = readbackHeight;
+        if (!stagingRing.init(device.Get(), cpuDesc, opts.stagingRingSize, opts.waitStrategy)) {
+            std::cerr << tag << "Failed to create staging textures\n";
+            return false;
+        }
+        sws_freeContext(swsCtx);
+        swsCtx = sws_getContext(readbackWidth & ~1, readbackHeight & ~1, AV_PIX_FMT_BGRA,
+                                width, height, AV_PIX_FMT_YUV420P,
+                                scalerFlags(opts.scaler), nullptr, nullptr, nullptr);
+        if (!swsCtx) {
+            std::cerr << tag << "sws_getContext failed for the new desktop size\n";
+            return false;
+        }
+        if (dirtyMode && ((readbackWidth & ~1) != width || (readbackHeight & ~1) != height)) {
+            // Dirty rects assume the desktop maps 1:1 onto the frame
+            std::cerr << tag << "Desktop size changed, converting whole frames from now on\n";
+            dirtyMode = false;
+            sceneReady = false; // the clean scene was sceneFrame until now
+        }
+        makeSliceConverter();
+        return true;
+    };
+
+    // Access to the desktop is lost on a mode change, the secure desktop
+    // (UAC, Ctrl+Alt+Del) and fullscreen switches. The duplication is
+    // recreated straight away and then with a bounded backoff; at a constant
+    // frame rate every slot meanwhile repeats the last frame, so the
+    // timeline keeps going. False when the pipeline cannot carry on.
+    auto recoverDuplication = [&](HRESULT reason) -> bool {
+        static const int backoffMs[] = { 0, 2, 5, 10, 20, 50, 100, 250 };
+        const int64_t lostAt = qpcNow();
+        const int oldWidth = desktop.width();
+        const int oldHeight = desktop.height();
+        int attempts = 0;
+        int held = 0;
+        HRESULT hr = E_FAIL;
+        while (!stopRecording) {
+            hr = desktop.duplicate(false);
+            ++attempts;
+            if (hr == S_OK || hr == DXGI_ERROR_DEVICE_REMOVED || hr == DXGI_ERROR_DEVICE_RESET) break;
+            int64_t retryAt = qpcNow() + backoffMs[std::min(attempts - 1, 7)] * qpcFrequency() / 1000;
+            for (;;) {
+                int64_t now = qpcNow();
+                if (!opts.vfr && postedFrame && now >= slotTime(pacingSlot)) {
+                    post({ StageItem::HOLD, -1, presentPts(now) });
+                    ++held;
+                    pacingSlot = (now - pacingStart) * targetFPS / qpcFrequency() + 1;
+                    continue;
+                }
+                if (now >= retryAt || stopRecording) break;
+                pacingTimer.waitUntil(std::min(retryAt, opts.vfr ? retryAt : slotTime(pacingSlot)));
+            }
+        }
+        if (hr != S_OK) {
+            if (!stopRecording) std::cerr << tag << "Duplication cannot be recreated (0x" << std::hex << hr << std::dec << ")\n";
+            return false;
+        }
+        drainStage();
+        if ((desktop.width() != oldWidth || desktop.height() != oldHeight) && !resizeCapture()) return false;
+        if (dirtyMode) dirtyTracker.invalidate(stagingRing.size());
+        lastHashValid = false;
+
+        int64_t lostMs = (qpcNow() - lostAt) * 1000 / qpcFrequency();
+        telemetry.recoveries.fetch_add(1, std::memory_order_relaxed);
+        telemetry.lostMsTotal.fetch_add(lostMs, std::memory_order_relaxed);
+        std::cout << tag << "Desktop access lost (0x" << std::hex << reason << std::dec << "), back after "
+                  << lostMs << " ms, " << attempts << " attempts, " << held << " frames held\n";
+        return true;
+    };
+
+    while (!stopRecording) {
+        int64_t now = qpcNow();
+        int64_t due = slotTime(pacingSlot);
+        if (now > slotTime(pacingSlot + 1)) {
+            // More than a slot late: resume at the next slot, not in a burst
+            pacingSlot = (now - pacingStart) * targetFPS / qpcFrequency() + 1;
+        } else {
+            if (now < due) pacingTimer.waitUntil(due);
+            ++pacingSlot;
+        }
+
+        // Adaptive frame rate: this slot is not captured
+        if (adaptive && pacingSlot % adaptive->divisor() != 0) continue;
+
+        if (stageTimers.reportIfDue()) dropStats.print((tag + "drops").c_str());
+        telemetry.dropped.store(dropStats.droppedNewest + dropStats.droppedOldest, std::memory_order_relaxed);
+        telemetry.poolEmpty.store(dropStats.poolEmpty, std::memory_order_relaxed);
+        telemetry.queueDepth.store(frameQueue.size(), std::memory_order_relaxed);
+        telemetry.updatedMs.store((int64_t)GetTickCount64(), std::memory_order_relaxed);
+
+        if (replay && config.replaySaves->load() != replaySavesSeen) {
+            replaySavesSeen = config.replaySaves->load();
+            saveReplay();
+        }
+
+        // A failed map or conversion left the scene frame behind its slots
+        if (dirtyReset.exchange(false)) {
+            drainStage();
+            dirtyTracker.invalidate(stagingRing.size());
+        }
+
+        ComPtr<ID3D11Texture2D> frameTexture;
+        DXGI_OUTDUPL_FRAME_INFO frameInfo = {};
+        int64_t t0 = qpcNow();
+        HRESULT acquired = desktop.acquire(250, frameInfo, frameTexture);
+        stageTimers.add(STAGE_ACQUIRE, qpcNow() - t0);
+        if (acquired == DXGI_ERROR_WAIT_TIMEOUT) {
+            telemetry.acquireTimeouts.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        if (acquired == DXGI_ERROR_DEVICE_REMOVED || acquired == DXGI_ERROR_DEVICE_RESET) {
+            // The encoder and every texture live on this device; end the
+            // recording cleanly rather than rebuild all of it
+            std::cerr << tag << "D3D11 device lost, stopping\n";
+            break;
+        }
+        if (acquired != S_OK) {
+            if (!recoverDuplication(acquired)) break;
+            continue;
+        }
+        telemetry.captured.fetch_add(1, std::memory_order_relaxed);
+        if (cursorCpu && desktop.pointer().version != publishedPointer) {
+            std::lock_guard<std::mutex> lock(pointerMutex);
+            pointerShared = desktop.pointer();
+            publishedPointer = pointerShared.version;
+        }
+        bool presented = frameInfo.LastPresentTime.QuadPart != 0;
+        bool pointerMoved = opts.cursor && desktop.pointer().version != shownPointer;
+        if (opts.vfr && !presented && !pointerMoved && lastPts >= 0) {
+            // Pointer-only update: nothing new to encode in VFR mode
+            desktop.release();
+            continue;
+        }
+        int64_t pts = presentPts(presented ? frameInfo.LastPresentTime.QuadPart : qpcNow());
+
+        // Only the pointer moved: a fresh copy of the last scene with the
+        // pointer in its new place, no readback
+        if (cursorCpu && !presented && pointerMoved && postedFrame) {
+            desktop.release();
+            post({ StageItem::SCENE, -1, pts });
+            shownPointer = desktop.pointer().version;
+            continue;
+        }
+
+        // Pointer-only update with the pointer unchanged or not drawn: the
+        // desktop image is the one already sent
+        if (detectStatic && !presented && postedFrame && !(cursorGpu && pointerMoved)) {
+            desktop.release();
+            post({ StageItem::UNCHANGED, -1, pts });
+            continue;
+        }
+
+        // Zero-copy: convert straight into an encoder-owned texture
+        if (hwEncode) {
+            AVFrame* hwFrame = acquireFrame(pts);
+            if (!hwFrame) {
+                desktop.release();
+                continue;
+            }
+            ID3D11Texture2D* target = (ID3D11Texture2D*)hwFrame->data[0];
+            UINT slice = (UINT)(intptr_t)hwFrame->data[1];
+            t0 = qpcNow();
+            bool converted = gpuConverter.convert(frameTexture.Get(), target, slice,
+                                                  cursorGpu ? &desktop.pointer() : nullptr);
+            shownPointer = desktop.pointer().version;
+            context->Flush();
+            desktop.release();
+            stageTimers.add(STAGE_CONVERT, qpcNow() - t0);
+            if (!converted) {
+                std::cerr << "GPU conversion failed\n";
+                framePool.putBack(hwFrame);
+                continue;
+            }
+            t0 = qpcNow();
+            hwFrame->pts = pts;
+            if (frameQueue.push({ hwFrame, pts })) haveFrame = postedFrame = true;
+            else framePool.putBack(hwFrame);
+            stageTimers.add(STAGE_ENQUEUE, qpcNow() - t0);
+            continue;
+        }
+
+        if (dirtyMode) {
+            // Only the pointer moved: reuse the last frame, no readback
+            if (!presented && postedFrame) {
+                desktop.release();
+                post({ StageItem::SCENE, -1, pts });
+                continue;
+            }
+            if (!getChangedRects(desktop.duplication(), frameInfo, metadataBuffer, frameRects, width, height)) {
+                frameRects.assign(1, dirtyTracker.fullRect());
+            }
+        }
+
+        // Every slot is still with the convert stage: wait for the oldest.
+        // The frame stays held meanwhile, as it would converting inline.
+        int slot = -1;
+        while (!stopRecording && (slot = stagingRing.acquire(100)) < 0) {}
+        if (slot < 0) {
+            desktop.release();
+            break;
+        }
+
+        t0 = qpcNow();
+        ID3D11Texture2D* staging = stagingRing.slot(slot);
+        if (useGpuConvert || useGpuScale) {
+            if (!gpuConverter.convert(frameTexture.Get())) {
+                std::cerr << "GPU conversion failed\n";
+                stagingRing.putBack(slot);
+                desktop.release();
+                continue;
+            }
+            context->CopyResource(staging, gpuConverter.output());
+        } else if (dirtyMode) {
+            for (const RECT& r : dirtyTracker.prepareSlot(slot, frameRects)) {
+                D3D11_BOX box = { (UINT)r.left, (UINT)r.top, 0, (UINT)r.right, (UINT)r.bottom, 1 };
+                context->CopySubresourceRegion(staging, 0, r.left, r.top, 0, frameTexture.Get(), 0, &box);
+            }
+        } else {
+            context->CopyResource(staging, frameTexture.Get());
+        }
+        context->Flush(); // start the copy now so the convert stage's map can succeed
+        desktop.release();
+        stageTimers.add(STAGE_COPY, qpcNow() - t0);
+        post({ StageItem::STAGED, slot, pts });
+        postedFrame = true;
+        shownPointer = desktop.pointer().version;
+    }
+
+    // Let the convert stage finish what was staged
+    if (convertThread.joinable()) {
+        stageQueue.close();
+        convertThread.join();
+    }
+    frameQueue.close();
+
+    encoderThread.join();
+    if (audioCapture) audioCapture->stop();
+    for (std::thread& t : replayDumps) t.join(); // they still reference the codec contexts
+    dropStats.print((tag + "drops total").c_str());
+
+    muxer.finish();
+    if (swsCtx) sws_freeContext(swsCtx);
+    av_frame_free(&sceneFrame);
+    avcodec_free_context(&codecCtx);
+    av_buffer_unref(&hwFramesCtx);
+    av_buffer_unref(&hwDeviceCtx);
+    audioCapture.reset();
+    CoUninitialize();
+
+    if (replay) {
+        std::cout << tag << "Replay buffer stopped, " << replayDumps.size() << " replays saved\n";
+    } else {
+        std::cout << tag << "Recording finished: " << muxer.firstFile();
+        if (muxer.segments() > 1) std::cout << " (+" << muxer.segments() - 1 << " more segments)";
+        std::cout << "\n";
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    signal(SIGINT, signalHandler);
+
+    RecorderOptions opts;
+    if (!parseOptions(argc, argv, opts)) return -1;
+    parseCoreList(opts.captureCores, threadPolicy.cores[(int)ThreadRole::Capture]);
+    parseCoreList(opts.encoderCores, threadPolicy.cores[(int)ThreadRole::Encoder]);
+    parseCoreList(opts.writerCores, threadPolicy.cores[(int)ThreadRole::Writer]);
+    parseCoreList(opts.audioCores, threadPolicy.cores[(int)ThreadRole::Audio]);
+    threadPolicy.cpuSets = opts.cpuSets;
+    threadPolicy.mmcssCapture = opts.mmcss;
+    threadPolicy.ecoEncoder = opts.ecoEncoder;
+    if (!opts.benchmark.empty()) return runBenchmark(opts) ? 0 : -1;
+    if (!opts.telemetryPrint.empty()) return printTelemetry(opts.telemetryPrint) ? 0 : -1;
+
+    std::vector<DisplayOutput> allOutputs = enumerateOutputs();
+    if (opts.listOutputs) {
+        for (const DisplayOutput& d : allOutputs) {
+            const RECT& r = d.desc.DesktopCoordinates;
+            std::cout << d.adapterIndex << ":" << d.outputIndex << "  " << d.deviceName << "  "
+                      << r.right - r.left << "x" << r.bottom - r.top << " at " << r.left << "," << r.top
+                      << (d.desc.AttachedToDesktop ? "" : " (detached)") << "  " << d.adapterName << "\n";
+        }
+        return 0;
+    }
+    std::vector<DisplayOutput> selected;
+    if (!selectOutputs(opts.outputs, allOutputs, selected)) return -1;
+
+    // One pipeline per output, or one for the lot when compositing. A
+    // composite lives in one texture, so its outputs must share an adapter.
+    const std::string baseName = getTimestampedBaseName();
+    std::vector<PipelineConfig> pipelines;
+    if (opts.composite && selected.size() > 1) {
+        for (const DisplayOutput& d : selected) {
+            if (d.adapterIndex != selected[0].adapterIndex) {
+                std::cerr << "--composite needs all outputs on one adapter\n";
+                return -1;
+            }
+        }
+        PipelineConfig config;
+        config.outputs = selected;
+        config.baseName = baseName;
+        pipelines.push_back(config);
+    } else {
+        for (size_t i = 0; i < selected.size(); ++i) {
+            PipelineConfig config;
+            config.outputs.push_back(selected[i]);
+            if (selected.size() > 1) config.label = "mon" + std::to_string(i);
+            config.baseName = config.label.empty() ? baseName : baseName + "_" + config.label;
+            pipelines.push_back(config);
+        }
+    }
+
+    // Each pipeline gets a block of cores of its own when there are at least
+    // two per pipeline (capture and encoder loop) and they fit one mask
+    const int totalCores = std::max(1, (int)std::thread::hardware_concurrency());
+    const int coresEach = std::max(1, totalCores / (int)pipelines.size());
+    const bool pin = pipelines.size() > 1 && coresEach >= 2 && totalCores <= (int)sizeof(DWORD_PTR) * 8;
+    Telemetry telemetry;
+    if (!telemetry.open(opts.telemetry, (int)pipelines.size())) return -1;
+    if (!opts.telemetry.empty()) std::cout << "Telemetry: Local\\" << opts.telemetry << "\n";
+    std::atomic<int> replaySaves{0};
+    for (size_t i = 0; i < pipelines.size(); ++i) {
+        PipelineConfig& config = pipelines[i];
+        config.telemetry = &telemetry.pipeline((int)i);
+        std::snprintf(config.telemetry->label, sizeof(config.telemetry->label), "%s",
+                      config.label.empty() ? "main" : config.label.c_str());
+        config.cores = coresEach;
+        if (pin) config.affinity = (((DWORD_PTR)1 << coresEach) - 1) << (i * coresEach);
+        config.audio = i == 0; // one copy of the loopback audio is enough
+        config.replaySaves = &replaySaves;
+        const DisplayOutput& d = config.outputs[0];
+        std::cout << (config.label.empty() ? "" : "[" + config.label + "] ") << "Output "
+                  << d.adapterIndex << ":" << d.outputIndex << " " << d.deviceName;
+        if (config.outputs.size() > 1) std::cout << " + " << config.outputs.size() - 1 << " more, composited";
+        std::cout << "\n";
+    }
+
+    avformat_network_init();
+
+    // A coarse system timer stretches every short sleep and poll in the
+    // pipelines; the pacing timer only needs it without high resolution
+    const UINT timerPeriod = opts.timerResolutionMs >= 0 ? (UINT)opts.timerResolutionMs
+                                                         : (PacingTimer::highResolutionAvailable() ? 0 : 1);
+    if (timerPeriod && timeBeginPeriod(timerPeriod) != TIMERR_NOERROR) {
+        std::cerr << "Timer resolution " << timerPeriod << " ms not available\n";
+    }
+
+    // Hotkeys arrive on this thread's queue; pipelines only watch the counter
+    const int replayHotkeyId = 1;
+    bool hotkey = false;
+    if (opts.replaySeconds) {
+        hotkey = RegisterHotKey(nullptr, replayHotkeyId, MOD_ALT | MOD_NOREPEAT, VK_F10) != 0;
+#ifdef SIGBREAK
+        signal(SIGBREAK, replaySignalHandler);
+#endif
+        std::cout << "Replay buffer: last " << opts.replaySeconds << " s (" << opts.replayMB << " MB). "
+                  << (hotkey ? "Alt+F10 or " : "") << "Ctrl+Break saves, Ctrl+C stops\n";
+    } else {
+        std::cout << "Recording... Ctrl+C to stop\n";
+    }
+
+    // A pipeline that fails to start stops the others too
+    std::vector<char> succeeded(pipelines.size(), 0);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < pipelines.size(); ++i) {
+        threads.emplace_back([&, i]() {
+            succeeded[i] = runPipeline(opts, pipelines[i]);
+            if (!succeeded[i]) stopRecording = true;
+        });
+    }
+
+    while (!stopRecording) {
+        MSG msg;
+        while (PeekMessage(&msg, nullptr, WM_HOTKEY, WM_HOTKEY, PM_REMOVE)) {
+            if (msg.wParam == replayHotkeyId) replayDumpRequested = true;
+        }
+        if (replayDumpRequested) {
+            replayDumpRequested = false;
+            replaySaves++;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    for (std::thread& t : threads) t.join();
+    if (timerPeriod) timeEndPeriod(timerPeriod);
+    if (hotkey) UnregisterHotKey(nullptr, replayHotkeyId);
+    return std::all_of(succeeded.begin(), succeeded.end(), [](char ok) { return ok != 0; }) ? 0 : -1;
+}